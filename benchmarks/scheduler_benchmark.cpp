@@ -0,0 +1,79 @@
+// scheduler_benchmark [max_threads]
+// Times two workloads on task schedulers of 1, 2, 4, ... up to max_threads workers (one per core by
+// default) and prints the speedup over one worker: a parallel for of many small tasks, like the resolve
+// and png bands, and recursive task groups that wait on their children, like nested loading jobs.
+#include "task_scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+    // some floating point work that the compiler cannot drop
+    double work(size_t seed, int iterations) {
+        double x = double(seed % 1000) * 0.001;
+        for (int i = 0; i < iterations; ++i)
+            x = std::sin(x) * 0.5 + std::sqrt(x + 1.0);
+        return x;
+    }
+
+    double parallel_for(task_scheduler &scheduler) {
+        const size_t task_count = 20000;
+        std::vector<double> results(task_count);
+        task_group group(scheduler);
+        for (size_t i = 0; i < task_count; ++i)
+            group.run([&results, i] { results[i] = work(i, 500); });
+        group.wait();
+        double sum = 0.0;
+        for (double r: results)
+            sum += r;
+        return sum;
+    }
+
+    double tree(task_scheduler &scheduler, size_t seed, int depth) {
+        if (depth == 0)
+            return work(seed, 2000);
+        double left = 0.0, right = 0.0;
+        task_group children(scheduler);
+        children.run([&] { left = tree(scheduler, seed * 2, depth - 1); });
+        children.run([&] { right = tree(scheduler, seed * 2 + 1, depth - 1); });
+        children.wait();
+        return left + right;
+    }
+
+    template<class F>
+    double milliseconds(F &&run, double &checksum) {
+        auto start = std::chrono::steady_clock::now();
+        checksum = run();
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+}
+
+int main(int argc, char **argv) {
+    unsigned max_threads = argc > 1 ? unsigned(std::max(1, std::atoi(argv[1])))
+                                    : std::max(1u, std::thread::hardware_concurrency());
+    std::printf("%8s %14s %8s %14s %8s\n", "threads", "for ms", "speedup", "tree ms", "speedup");
+    double for_base = 0.0, tree_base = 0.0;
+    for (unsigned threads = 1;; threads = std::min(threads * 2, max_threads)) {
+        task_scheduler scheduler(threads);
+        double for_sum, tree_sum;
+        // best of three, the first run also warms the workers up
+        double for_ms = 1e30, tree_ms = 1e30;
+        for (int run = 0; run < 3; ++run) {
+            for_ms = std::min(for_ms, milliseconds([&] { return parallel_for(scheduler); }, for_sum));
+            tree_ms = std::min(tree_ms, milliseconds([&] { return tree(scheduler, 1, 14); }, tree_sum));
+        }
+        if (threads == 1) {
+            for_base = for_ms;
+            tree_base = tree_ms;
+        }
+        std::printf("%8u %14.1f %8.2f %14.1f %8.2f   (%g %g)\n", threads, for_ms, for_base / for_ms, tree_ms,
+                    tree_base / tree_ms, for_sum, tree_sum);
+        if (threads == max_threads)
+            break;
+    }
+    return 0;
+}
@@ -0,0 +1,82 @@
+#ifndef RAYTRACING_ACCUMULATOR_H
+#define RAYTRACING_ACCUMULATOR_H
+
+#include "vector"
+#include "cmath"
+#include "algorithm"
+#include "glm/glm.hpp"
+#include "utils.h"
+#include "framebuffer.h"
+
+// Progressive average of frames rendered with subpixel jittered projections, in linear color. The
+// luminance variance of every pixel is tracked (Welford) so rendering can stop once another frame
+// would no longer change the image visibly.
+class accumulator {
+public:
+    accumulator(int w, int h) : frame(size_t(w) * h), mean(size_t(w) * h), luminance_mean(size_t(w) * h),
+                                luminance_m2(size_t(w) * h) {}
+
+    void reset() {
+        frame_count = 0;
+    }
+
+    int get_frame_count() const {
+        return frame_count;
+    }
+
+    // Subpixel offset of frame n in [-0.5, 0.5), Halton(2, 3) covers the pixel evenly for any count.
+    static glm::vec2 jitter(int n) {
+        return {halton(n + 1, 2) - 0.5f, halton(n + 1, 3) - 0.5f};
+    }
+
+    // fb has to be as large as the accumulator
+    void add(const framebuffer &fb) {
+        fb.read_linear(frame.data());
+        ++frame_count;
+        const float weight = 1.0f / frame_count;
+        for (size_t i = 0; i < frame.size(); ++i) {
+            if (frame_count == 1) {
+                mean[i] = frame[i];
+                luminance_mean[i] = luminance(frame[i]);
+                luminance_m2[i] = 0.0f;
+                continue;
+            }
+            mean[i] += (frame[i] - mean[i]) * weight;
+            float l = luminance(frame[i]);
+            float delta = l - luminance_mean[i];
+            luminance_mean[i] += delta * weight;
+            luminance_m2[i] += delta * (l - luminance_mean[i]);
+        }
+    }
+
+    // Standard error of the mean luminance that all but the worst 0.1% of the pixels are below, infinite
+    // until there are two frames. Every pixel has to converge on its own, however many pixels around it
+    // already have, only a few stray pixels cannot hold the early stop back forever.
+    float get_error() const {
+        if (frame_count < 2)
+            return INFINITY;
+        std::vector<float> m2(luminance_m2);
+        size_t rank = m2.size() - 1 - m2.size() / 1000;
+        std::nth_element(m2.begin(), m2.begin() + rank, m2.end());
+        // variance of the mean is m2 / (n - 1) / n
+        return static_cast<float>(std::sqrt(m2[rank] / (double(frame_count - 1) * frame_count)));
+    }
+
+    // Writes the current average into the frame buffer, ready for any of the output paths.
+    void store(framebuffer &fb) const {
+        fb.write_linear(mean.data());
+    }
+
+private:
+    int frame_count = 0;
+    std::vector<glm::vec4> frame;
+    std::vector<glm::vec4> mean;
+    std::vector<float> luminance_mean;
+    std::vector<float> luminance_m2;
+
+    static float luminance(const glm::vec4 &color) {
+        return 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b;
+    }
+};
+
+#endif //RAYTRACING_ACCUMULATOR_H
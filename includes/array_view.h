@@ -0,0 +1,46 @@
+#ifndef RAYTRACING_ARRAY_VIEW_H
+#define RAYTRACING_ARRAY_VIEW_H
+
+#include "cstddef"
+
+// Non owning view of a contiguous array, the subset of C++20 std::span the renderer needs.
+template<class T>
+class array_view {
+public:
+    array_view() = default;
+
+    array_view(T *_data, size_t _size) : pointer(_data), count(_size) {}
+
+    template<class Container>
+    array_view(Container &container) : pointer(container.data()), count(container.size()) {}
+
+    T *data() const {
+        return pointer;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    T &operator[](size_t i) const {
+        return pointer[i];
+    }
+
+    T *begin() const {
+        return pointer;
+    }
+
+    T *end() const {
+        return pointer + count;
+    }
+
+private:
+    T *pointer = nullptr;
+    size_t count = 0;
+};
+
+#endif //RAYTRACING_ARRAY_VIEW_H
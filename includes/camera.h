@@ -4,6 +4,7 @@
 
 #include "glm/glm.hpp"
 #include <glm/gtc/matrix_transform.hpp>
+#include "frustum.h"
 
 class camera {
 public:
@@ -15,19 +16,24 @@ public:
             float z_near,
             float z_far,
             glm::vec3 vup = glm::vec3(0, 1, 0)
-    ) : position(_position), target(_target), fov(vfov), aspect_ratio(aspect_ratio), z_near(z_near), z_far(z_far) {
-        float theta = glm::radians(vfov);
-        float h = glm::tan(theta / 2);
-        float viewport_height = 2.0 * h;
-        float viewport_width = aspect_ratio * viewport_height;
+    ) : position(_position), target(_target), up(vup), fov(vfov), aspect_ratio(aspect_ratio), z_near(z_near),
+        z_far(z_far) {
+        update_basis();
+    }
 
-        w = glm::normalize(position - target);
-        u = glm::normalize(glm::cross(vup, w));
-        v = glm::cross(w, u);
+    const glm::vec3 &get_position() const {
+        return position;
+    }
 
-        horizontal = viewport_width * u;
-        vertical = viewport_height * v;
-        lower_left_corner = position - horizontal / 2.0f - vertical / 2.0f - w;
+    void set_position(const glm::vec3 &_position) {
+        position = _position;
+        update_basis();
+    }
+
+    // Rotates the camera around its target about the up axis, for turntables.
+    void orbit(float degrees) {
+        glm::mat4 rotation = glm::rotate(glm::mat4(1.0f), glm::radians(degrees), up);
+        set_position(target + glm::vec3(rotation * glm::vec4(position - target, 0.0f)));
     }
 
 //    ray get_ray(float s, float t) const {
@@ -36,16 +42,32 @@ public:
 
     glm::mat4 get_view_matrix() {
         glm::mat4 view = glm::mat4(1.0f);
-        return glm::lookAt(position, target, {0.0f, 1.0f, 0.0f});
+        return glm::lookAt(position, target, up);
     }
 
     glm::mat4 get_projection_matrix() {
         return glm::perspective(glm::radians(fov), aspect_ratio, z_near, z_far);
     }
 
+    // World space frustum of the view and projection above.
+    frustum get_frustum() {
+        return frustum(get_projection_matrix() * get_view_matrix());
+    }
+
+    // The projection for an image_width x image_height image with every pixel sampled at an offset of
+    // jitter pixels from its center.
+    glm::mat4 get_jittered_projection_matrix(const glm::vec2 &jitter, int image_width, int image_height) {
+        glm::mat4 projection = get_projection_matrix();
+        // added to x and y before the division by w, so the shift is the same at every depth
+        projection[2][0] -= 2.0f * jitter.x / image_width;
+        projection[2][1] -= 2.0f * jitter.y / image_height;
+        return projection;
+    }
+
 private:
     glm::vec3 position;
     glm::vec3 target;
+    glm::vec3 up;
     glm::vec3 lower_left_corner;
     glm::vec3 horizontal;
     glm::vec3 vertical;
@@ -54,6 +76,21 @@ private:
     float aspect_ratio;
     float z_near;
     float z_far;
+
+    void update_basis() {
+        float theta = glm::radians(fov);
+        float h = glm::tan(theta / 2);
+        float viewport_height = 2.0 * h;
+        float viewport_width = aspect_ratio * viewport_height;
+
+        w = glm::normalize(position - target);
+        u = glm::normalize(glm::cross(up, w));
+        v = glm::cross(w, u);
+
+        horizontal = viewport_width * u;
+        vertical = viewport_height * v;
+        lower_left_corner = position - horizontal / 2.0f - vertical / 2.0f - w;
+    }
 };
 
 #endif //RAYTRACING_CAMERA_H
@@ -0,0 +1,207 @@
+#ifndef RAYTRACING_FRAME_RING_H
+#define RAYTRACING_FRAME_RING_H
+
+#include "string"
+#include "memory"
+#include "atomic"
+#include "cstring"
+#include "cstdint"
+#include "iostream"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Ring of resolved 8 bit frames in POSIX shared memory. The renderer creates it and resolves each
+// frame straight into the next slot, viewers and encoders in other processes open it by name and read
+// the pixels in place.
+//
+// Layout: header, slot_count slot headers, then the pixels of every slot, each starting on its own
+// page. Rows are stored top down. A slot's sequence is odd while the renderer writes it and even once
+// it is published, a reader that sees the same even sequence before and after reading got a whole frame.
+class frame_ring {
+public:
+    struct header {
+        char magic[8];
+        uint32_t version;
+        uint32_t slot_count;
+        uint32_t width;
+        uint32_t height;
+        uint32_t channel;
+        uint32_t reserved;
+        uint64_t slot_bytes;
+        uint64_t pixel_offset;
+        // frames published so far, the newest one is in slot (frames_published - 1) % slot_count
+        std::atomic<uint64_t> frames_published;
+    };
+
+    struct slot {
+        std::atomic<uint64_t> sequence;
+        uint64_t frame_index;
+        // 1 once the slot has been published at least once
+        std::atomic<uint32_t> ready;
+        uint32_t reserved;
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "frame_ring needs lock free 64 bit atomics");
+
+    static constexpr uint32_t format_version = 1;
+
+    // Creates (or replaces) the ring, name is a shm name such as "/minirender". The ring outlives the
+    // renderer so the last frames stay readable, remove() deletes it.
+    static std::unique_ptr<frame_ring> create(const std::string &name, int slot_count, int width, int height,
+                                              int channel) {
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t slot_bytes = size_t(width) * height * channel;
+        size_t pixel_offset = align(sizeof(header) + slot_count * sizeof(slot), page);
+        size_t size = pixel_offset + align(slot_bytes, page) * slot_count;
+
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0 || ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            if (fd >= 0) {
+                ::close(fd);
+                shm_unlink(name.c_str());
+            }
+            std::cerr << "ERROR: Could not create shared memory frame ring '" << name << "'.\n";
+            return nullptr;
+        }
+        void *address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (address == MAP_FAILED) {
+            shm_unlink(name.c_str());
+            return nullptr;
+        }
+
+        // ftruncate zero fills, so every slot starts unpublished
+        auto ring = std::unique_ptr<frame_ring>(new frame_ring(address, size));
+        header &h = *ring->head();
+        h.version = format_version;
+        h.slot_count = slot_count;
+        h.width = width;
+        h.height = height;
+        h.channel = channel;
+        h.slot_bytes = slot_bytes;
+        h.pixel_offset = pixel_offset;
+        // the magic goes last, readers treat a ring without it as not ready yet
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(h.magic, "MRRING\0\0", sizeof(h.magic));
+        return ring;
+    }
+
+    // Maps an existing ring read only, nullptr if it does not exist or is not initialized yet.
+    static std::unique_ptr<frame_ring> open(const std::string &name) {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            return nullptr;
+        struct stat info{};
+        if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(header)) {
+            ::close(fd);
+            return nullptr;
+        }
+        void *address = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (address == MAP_FAILED)
+            return nullptr;
+        auto ring = std::unique_ptr<frame_ring>(new frame_ring(address, info.st_size));
+        const header &h = ring->get_header();
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        if (std::memcmp(h.magic, "MRRING\0\0", sizeof(h.magic)) != 0 || h.version != format_version ||
+            h.slot_count == 0 || h.pixel_offset + align(h.slot_bytes, page) * h.slot_count > ring->length)
+            return nullptr;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return ring;
+    }
+
+    static void remove(const std::string &name) {
+        shm_unlink(name.c_str());
+    }
+
+    ~frame_ring() {
+        munmap(address, length);
+    }
+
+    frame_ring(const frame_ring &) = delete;
+
+    frame_ring &operator=(const frame_ring &) = delete;
+
+    const header &get_header() const {
+        return *static_cast<const header *>(address);
+    }
+
+    // Writer side: marks the next slot as being written and returns its pixels.
+    unsigned char *begin_frame() {
+        uint32_t index = current_slot();
+        slot_at(index).sequence.fetch_add(1, std::memory_order_relaxed);
+        // keeps the pixel writes after the odd sequence
+        std::atomic_thread_fence(std::memory_order_release);
+        return pixels(index);
+    }
+
+    // Writer side: publishes the slot returned by the last begin_frame().
+    void publish() {
+        uint64_t frame = head()->frames_published.load(std::memory_order_relaxed);
+        slot &s = slot_at(current_slot());
+        s.frame_index = frame;
+        s.sequence.fetch_add(1, std::memory_order_release);
+        s.ready.store(1, std::memory_order_release);
+        head()->frames_published.store(frame + 1, std::memory_order_release);
+    }
+
+    // Reader side: calls consume(pixels, frame_index) on the newest published frame, in place. Returns
+    // false when nothing is published yet or the renderer overwrote the slot while it was read, in
+    // which case whatever consume did with the pixels has to be discarded.
+    template<class F>
+    bool read_latest(F &&consume) const {
+        uint64_t published = get_header().frames_published.load(std::memory_order_acquire);
+        if (published == 0)
+            return false;
+        uint32_t index = static_cast<uint32_t>((published - 1) % get_header().slot_count);
+        const slot &s = slot_at(index);
+        uint64_t before = s.sequence.load(std::memory_order_acquire);
+        if ((before & 1) || !s.ready.load(std::memory_order_acquire))
+            return false;
+        uint64_t frame = s.frame_index;
+        consume(pixels(index), frame);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return s.sequence.load(std::memory_order_relaxed) == before;
+    }
+
+    const unsigned char *pixels(uint32_t index) const {
+        return static_cast<const unsigned char *>(address) + get_header().pixel_offset +
+               index * align(get_header().slot_bytes, static_cast<size_t>(sysconf(_SC_PAGESIZE)));
+    }
+
+private:
+    void *address;
+    size_t length;
+
+    frame_ring(void *_address, size_t _length) : address(_address), length(_length) {}
+
+    static size_t align(size_t offset, size_t alignment) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    header *head() {
+        return static_cast<header *>(address);
+    }
+
+    uint32_t current_slot() const {
+        return static_cast<uint32_t>(get_header().frames_published.load(std::memory_order_relaxed) %
+                                     get_header().slot_count);
+    }
+
+    slot &slot_at(uint32_t index) {
+        return reinterpret_cast<slot *>(static_cast<char *>(address) + sizeof(header))[index];
+    }
+
+    const slot &slot_at(uint32_t index) const {
+        return reinterpret_cast<const slot *>(static_cast<const char *>(address) + sizeof(header))[index];
+    }
+
+    unsigned char *pixels(uint32_t index) {
+        return const_cast<unsigned char *>(static_cast<const frame_ring *>(this)->pixels(index));
+    }
+};
+
+#endif //RAYTRACING_FRAME_RING_H
@@ -3,72 +3,549 @@
 
 #include "iostream"
 #include "vector"
+#include "array"
+#include "algorithm"
+#include "cstring"
 #include "glm/glm.hpp"
 #include "utils.h"
+#include "task_scheduler.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MINIRENDER_SSE2
+#endif
+
+enum class tonemap_operator {
+    none,
+    reinhard,
+    aces
+};
+
+// Applied once per pixel when the linear color buffer is converted to the 8 bit output.
+struct resolve_settings {
+    float exposure = 1.0f;
+    tonemap_operator tonemap = tonemap_operator::none;
+    float gamma = 2.2f;
+};
+
+// Exposure, tonemap and clamp run in SIMD registers, gamma and quantization go through a 12 bit
+// lookup table instead of a pow per channel. The table is indexed by the square root of the linear
+// value, gamma is steepest near black and a linear index would leave the darkest codes out.
+class color_resolver {
+public:
+    static constexpr int lut_bits = 12;
+    static constexpr int lut_size = 1 << lut_bits;
+
+    void resolve(const glm::vec4 *src, unsigned char *dst, size_t count, int channel,
+                 const resolve_settings &settings) {
+        if (settings.gamma != lut_gamma)
+            build_lut(settings.gamma);
+        for (size_t i = 0; i < count; ++i) {
+            int index[4];
+            resolve_index(src[i], settings, index);
+            for (int c = 0; c < channel; ++c)
+                *dst++ = c < 3 ? gamma_lut[index[c]] : static_cast<unsigned char>(index[c] >> (lut_bits - 8));
+        }
+    }
+
+    void resolve_pixel(const glm::vec4 &src, unsigned char *dst, int channel, const resolve_settings &settings) {
+        resolve(&src, dst, 1, channel, settings);
+    }
+
+private:
+    std::array<unsigned char, lut_size> gamma_lut{};
+    float lut_gamma = -1.0f;
+
+    void build_lut(float gamma) {
+        for (int i = 0; i < lut_size; ++i) {
+            // (i / (lut_size - 1))^2 to the power of 1 / gamma
+            float value = std::pow(i / float(lut_size - 1), 2.0f / gamma);
+            gamma_lut[i] = static_cast<unsigned char>(std::clamp(value * 255.0f + 0.5f, 0.0f, 255.0f));
+        }
+        lut_gamma = gamma;
+    }
+
+    static void resolve_index(const glm::vec4 &color, const resolve_settings &settings, int *index) {
+#ifdef MINIRENDER_SSE2
+        __m128 c = _mm_loadu_ps(&color[0]);
+        // exposure and tonemap only touch rgb, alpha stays linear
+        const __m128 rgb_mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+        __m128 mapped = _mm_mul_ps(c, _mm_set1_ps(settings.exposure));
+        const __m128 one = _mm_set1_ps(1.0f);
+        if (settings.tonemap == tonemap_operator::reinhard) {
+            mapped = _mm_div_ps(mapped, _mm_add_ps(one, mapped));
+        } else if (settings.tonemap == tonemap_operator::aces) {
+            // Narkowicz fit of the ACES filmic curve
+            __m128 numerator = _mm_mul_ps(mapped, _mm_add_ps(_mm_mul_ps(mapped, _mm_set1_ps(2.51f)), _mm_set1_ps(0.03f)));
+            __m128 denominator = _mm_add_ps(
+                    _mm_mul_ps(mapped, _mm_add_ps(_mm_mul_ps(mapped, _mm_set1_ps(2.43f)), _mm_set1_ps(0.59f))),
+                    _mm_set1_ps(0.14f));
+            mapped = _mm_div_ps(numerator, denominator);
+        }
+        mapped = _mm_sqrt_ps(_mm_min_ps(_mm_max_ps(mapped, _mm_setzero_ps()), one));
+        c = _mm_min_ps(_mm_max_ps(c, _mm_setzero_ps()), one);
+        c = _mm_or_ps(_mm_and_ps(rgb_mask, mapped), _mm_andnot_ps(rgb_mask, c));
+        __m128i quantized = _mm_cvtps_epi32(_mm_mul_ps(c, _mm_set1_ps(float(lut_size - 1))));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(index), quantized);
+#else
+        for (int c = 0; c < 4; ++c) {
+            float value = color[c];
+            if (c < 3) {
+                value *= settings.exposure;
+                if (settings.tonemap == tonemap_operator::reinhard)
+                    value = value / (1.0f + value);
+                else if (settings.tonemap == tonemap_operator::aces)
+                    value = (value * (2.51f * value + 0.03f)) / (value * (2.43f * value + 0.59f) + 0.14f);
+                value = std::sqrt(std::clamp(value, 0.0f, 1.0f));
+            }
+            index[c] = static_cast<int>(std::clamp(value, 0.0f, 1.0f) * (lut_size - 1) + 0.5f);
+        }
+#endif
+    }
+};
+
+enum class depth_format {
+    // 32 bit float ndc depth
+    d32f,
+    // 16 bit unorm
+    d16,
+    // 24 bit unorm depth in the high bits, 8 bits of stencil or id in the low bits
+    d24s8
+};
+
+// Per format encoding and a 4 wide compare-and-store. Depth is ndc z in [-1, 1], the unorm formats
+// store it remapped to [0, 1]. A fragment passes when its encoded depth is less than the stored one.
+struct depth_codec {
+    static int bytes_per_texel(depth_format format) {
+        return format == depth_format::d16 ? 2 : 4;
+    }
+
+    static uint32_t encode(depth_format format, float z) {
+        if (format == depth_format::d32f) {
+            uint32_t bits;
+            std::memcpy(&bits, &z, 4);
+            return bits;
+        }
+        float unorm = std::clamp(z * 0.5f + 0.5f, 0.0f, 1.0f);
+        if (format == depth_format::d16)
+            return static_cast<uint32_t>(std::lrint(unorm * 65535.0f));
+        return static_cast<uint32_t>(std::lrint(unorm * 16777215.0f)) << 8;
+    }
+
+    static float decode(depth_format format, uint32_t bits) {
+        if (format == depth_format::d32f) {
+            float z;
+            std::memcpy(&z, &bits, 4);
+            return z;
+        }
+        float unorm = format == depth_format::d16 ? bits / 65535.0f : (bits >> 8) / 16777215.0f;
+        return unorm * 2.0f - 1.0f;
+    }
+
+    static uint32_t load(depth_format format, const unsigned char *texel) {
+        if (format == depth_format::d16) {
+            uint16_t bits;
+            std::memcpy(&bits, texel, 2);
+            return bits;
+        }
+        uint32_t bits;
+        std::memcpy(&bits, texel, 4);
+        return bits;
+    }
+
+    static void store(depth_format format, unsigned char *texel, uint32_t bits) {
+        if (format == depth_format::d16) {
+            auto value = static_cast<uint16_t>(bits);
+            std::memcpy(texel, &value, 2);
+        } else {
+            std::memcpy(texel, &bits, 4);
+        }
+    }
+
+    // Tests four consecutive texels against z[0..3] for the lanes set in mask, stores the passing
+    // depths (keeping the stencil bits of d24s8) and returns the mask of passing lanes.
+    static int test_and_store4(depth_format format, unsigned char *texels, const float *z, int mask) {
+#ifdef MINIRENDER_SSE2
+        const __m128i lanes = _mm_cmpgt_epi32(
+                _mm_and_si128(_mm_set1_epi32(mask), _mm_set_epi32(8, 4, 2, 1)), _mm_setzero_si128());
+        __m128 depth = _mm_loadu_ps(z);
+        if (format == depth_format::d32f) {
+            __m128 stored = _mm_loadu_ps(reinterpret_cast<const float *>(texels));
+            __m128 pass = _mm_and_ps(_mm_cmplt_ps(depth, stored), _mm_castsi128_ps(lanes));
+            _mm_storeu_ps(reinterpret_cast<float *>(texels),
+                          _mm_or_ps(_mm_and_ps(pass, depth), _mm_andnot_ps(pass, stored)));
+            return _mm_movemask_ps(pass);
+        }
+        __m128 unorm = _mm_add_ps(_mm_mul_ps(depth, _mm_set1_ps(0.5f)), _mm_set1_ps(0.5f));
+        unorm = _mm_min_ps(_mm_max_ps(unorm, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+        if (format == depth_format::d16) {
+            // both sides fit in 16 bits, so the signed 32 bit compare is exact
+            __m128i quantized = _mm_cvtps_epi32(_mm_mul_ps(unorm, _mm_set1_ps(65535.0f)));
+            __m128i stored = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(texels)),
+                                                _mm_setzero_si128());
+            __m128i pass = _mm_and_si128(_mm_cmplt_epi32(quantized, stored), lanes);
+            __m128i merged = _mm_or_si128(_mm_and_si128(pass, quantized), _mm_andnot_si128(pass, stored));
+            // no unsigned 32 -> 16 pack before SSE4.1, bias into the signed range and back
+            const __m128i bias = _mm_set1_epi32(32768);
+            merged = _mm_packs_epi32(_mm_sub_epi32(merged, bias), _mm_sub_epi32(merged, bias));
+            merged = _mm_xor_si128(merged, _mm_set1_epi16(static_cast<short>(0x8000)));
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(texels), merged);
+            return _mm_movemask_ps(_mm_castsi128_ps(pass));
+        }
+        __m128i quantized = _mm_cvtps_epi32(_mm_mul_ps(unorm, _mm_set1_ps(16777215.0f)));
+        __m128i stored = _mm_loadu_si128(reinterpret_cast<const __m128i *>(texels));
+        __m128i pass = _mm_and_si128(_mm_cmplt_epi32(quantized, _mm_srli_epi32(stored, 8)), lanes);
+        __m128i written = _mm_or_si128(_mm_slli_epi32(quantized, 8), _mm_and_si128(stored, _mm_set1_epi32(0xff)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(texels),
+                         _mm_or_si128(_mm_and_si128(pass, written), _mm_andnot_si128(pass, stored)));
+        return _mm_movemask_ps(_mm_castsi128_ps(pass));
+#else
+        int stride = bytes_per_texel(format);
+        int passed = 0;
+        for (int k = 0; k < 4; ++k) {
+            if (!(mask & (1 << k)))
+                continue;
+            unsigned char *texel = texels + k * stride;
+            uint32_t stored = load(format, texel);
+            uint32_t bits = encode(format, z[k]);
+            bool pass;
+            if (format == depth_format::d32f)
+                pass = z[k] < decode(format, stored);
+            else if (format == depth_format::d16)
+                pass = bits < stored;
+            else
+                pass = (bits >> 8) < (stored >> 8);
+            if (!pass)
+                continue;
+            store(format, texel, format == depth_format::d24s8 ? bits | (stored & 0xff) : bits);
+            passed |= 1 << k;
+        }
+        return passed;
+#endif
+    }
+};
+
+enum class framebuffer_layout {
+    // row major, as in the output image
+    linear,
+    // contiguous 16x16 color tiles and 8x8 depth tiles, linearized by resolve()
+    tiled
+};
 
 class framebuffer {
 public:
+    static constexpr int color_tile_shift = 4;
+    static constexpr int depth_tile_shift = 3;
+    static constexpr int color_tile_size = 1 << color_tile_shift;
+    static constexpr int depth_tile_size = 1 << depth_tile_shift;
+
     int width, height, channel;
+    framebuffer_layout layout;
+    // resolved 8 bit output, only valid after resolve()
     unsigned char *buffer_data;
-    std::vector<float> depth_buffer;
+    // 1, or 4 for multisampling, the samples of a pixel are stored next to each other
+    int samples;
+    // linear color written by the rasterizer, pixel i starts at color_index() * samples
+    std::vector<glm::vec4> color_buffer;
+    depth_format depth;
+    // encoded depth_format texels, pixel i starts at depth_index() * samples
+    std::vector<unsigned char> depth_buffer;
+    resolve_settings settings;
 
 
     ~framebuffer() {
         delete[] buffer_data;
     };
 
-    framebuffer(const int &w = 800, const int &h = 600, const int &c = 3) : width(w), height(h), channel(c) {
-        //RGB
-        buffer_data = new unsigned char[width * height * channel];
-        depth_buffer.resize(w * h, 1.0f);
+    framebuffer(const int &w = 800, const int &h = 600, const int &c = 3,
+                framebuffer_layout _layout = framebuffer_layout::tiled,
+                depth_format _depth = depth_format::d32f, int _samples = 1) : channel(c), layout(_layout),
+                                                                              buffer_data(nullptr),
+                                                                              samples(_samples >= 4 ? 4 : 1),
+                                                                              depth(_depth) {
+        resize_buffer(w, h);
     }
 
     void resize_buffer(const int &w, const int &h) {
         width = w;
         height = h;
+        color_tiles_x = (width + color_tile_size - 1) >> color_tile_shift;
+        depth_tiles_x = (width + depth_tile_size - 1) >> depth_tile_shift;
+        int color_tiles_y = (height + color_tile_size - 1) >> color_tile_shift;
+        int depth_tiles_y = (height + depth_tile_size - 1) >> depth_tile_shift;
 
         delete[] buffer_data;
         buffer_data = new unsigned char[width * height * channel];
-        depth_buffer.resize(w * h, 1.0f);
+        if (layout == framebuffer_layout::tiled) {
+            color_buffer.resize((size_t(color_tiles_x * color_tiles_y) << (2 * color_tile_shift)) * samples);
+            depth_buffer.resize((size_t(depth_tiles_x * depth_tiles_y) << (2 * depth_tile_shift)) * samples *
+                                depth_stride());
+        } else {
+            color_buffer.resize(size_t(w) * h * samples);
+            // depth_test4 may read past the last pixel of a row
+            depth_buffer.resize((size_t(w) * h * samples + 4) * depth_stride());
+        }
+        color_tile_cleared.resize(color_tiles_x * color_tiles_y);
+        depth_tile_cleared.resize(depth_tiles_x * depth_tiles_y);
+        clear_color_buffer(glm::vec4(0.0f));
+        clear_depth_buffer(1.0f);
+    }
+
+    size_t color_index(int x, int y) const {
+        if (layout == framebuffer_layout::linear)
+            return size_t(y) * width + x;
+        size_t tile = size_t(y >> color_tile_shift) * color_tiles_x + (x >> color_tile_shift);
+        return (tile << (2 * color_tile_shift)) + ((y & (color_tile_size - 1)) << color_tile_shift) +
+               (x & (color_tile_size - 1));
+    }
+
+    size_t depth_index(int x, int y) const {
+        if (layout == framebuffer_layout::linear)
+            return size_t(y) * width + x;
+        size_t tile = size_t(y >> depth_tile_shift) * depth_tiles_x + (x >> depth_tile_shift);
+        return (tile << (2 * depth_tile_shift)) + ((y & (depth_tile_size - 1)) << depth_tile_shift) +
+               (x & (depth_tile_size - 1));
     }
 
     float get_depth(const int &x, const int &y) {
         if (x < 0 || x >= width || y < 0 || y >= height)
             return 1.0;
-        return *(depth_buffer.data() + y * width + x);
+        if (depth_tile_cleared[depth_tile(x, y)])
+            return depth_codec::decode(depth, clear_depth_bits);
+        return depth_codec::decode(depth, depth_codec::load(depth, depth_texel(x, y)));
     }
 
-    void write_depth(const int &x, const int &y, const float &depth) {
+    // writes every sample of the pixel
+    void write_depth(const int &x, const int &y, const float &z) {
         if (x < 0 || x >= width || y < 0 || y >= height)
             return;
-        float *p = depth_buffer.data();
-        *(p + y * width + x) = depth;
+        touch_depth_tile(depth_tile(x, y));
+        uint32_t bits = depth_codec::encode(depth, z);
+        for (int s = 0; s < samples; ++s) {
+            unsigned char *texel = depth_texel(x, y) + s * depth_stride();
+            uint32_t stencil = depth == depth_format::d24s8 ? depth_codec::load(depth, texel) & 0xff : 0;
+            depth_codec::store(depth, texel, bits | stencil);
+        }
     }
 
-    void clear_color_buffer(const glm::vec4 &color) {
-        int length = width * height * channel;
-        auto pixel_data = buffer_data;
-        for (int i = 0; i < length; i += channel) {
-            for (int c = 0; c < channel; ++c) {
-                auto channel_value = std::pow(color[c], 1.0f / 2.2f);
-                *pixel_data++ = static_cast<unsigned char>(std::clamp(channel_value * 255.99, 0.0, 255.0));
-            }
+    // Depth test for the four pixels x..x+3 of row y, x must be a multiple of 4. Passing depths are
+    // written, the returned mask has bit k set when pixel x+k passed. Single sample framebuffers only.
+    int depth_test4(int x, int y, const float *z, int mask) {
+        if (y < 0 || y >= height || x < 0 || x >= width)
+            return 0;
+        mask &= (1 << std::min(4, width - x)) - 1;
+        if (!mask)
+            return 0;
+        touch_depth_tile(depth_tile(x, y));
+        return depth_codec::test_and_store4(depth, depth_texel(x, y), z, mask);
+    }
+
+    // Depth test for the 4 samples of a multisampled pixel, coverage has bit s set for every sample the
+    // triangle covers. Returns the samples that passed, their depths are written.
+    int depth_test_samples(int x, int y, const float *z, int coverage) {
+        if (x < 0 || x >= width || y < 0 || y >= height || !coverage)
+            return 0;
+        touch_depth_tile(depth_tile(x, y));
+        return depth_codec::test_and_store4(depth, depth_texel(x, y), z, coverage);
+    }
+
+    // Position of sample s inside the pixel, a rotated grid so that near horizontal and near vertical
+    // edges both see 4 distinct sample rows and columns.
+    static glm::vec2 sample_position(int s) {
+        static const glm::vec2 positions[4] = {
+                {0.375f, 0.125f}, {0.875f, 0.375f}, {0.125f, 0.625f}, {0.625f, 0.875f}
+        };
+        return positions[s];
+    }
+
+    // The low 8 bits of d24s8, free for a stencil value or an id.
+    unsigned char get_stencil(int x, int y) {
+        if (depth != depth_format::d24s8 || x < 0 || x >= width || y < 0 || y >= height)
+            return 0;
+        if (depth_tile_cleared[depth_tile(x, y)])
+            return 0;
+        return depth_codec::load(depth, depth_texel(x, y)) & 0xff;
+    }
+
+    void write_stencil(int x, int y, unsigned char value) {
+        if (depth != depth_format::d24s8 || x < 0 || x >= width || y < 0 || y >= height)
+            return;
+        touch_depth_tile(depth_tile(x, y));
+        for (int s = 0; s < samples; ++s) {
+            unsigned char *texel = depth_texel(x, y) + s * depth_stride();
+            depth_codec::store(depth, texel, (depth_codec::load(depth, texel) & ~0xffu) | value);
         }
     }
 
-    void set_pixel(int x, int y, glm::vec4 pixel_color, int samples_per_pixel = 1) {
+    // Clears only record the value, a tile is filled on its first write or at resolve.
+    const glm::vec4 &get_clear_color() const {
+        return clear_color;
+    }
+
+    void clear_color_buffer(const glm::vec4 &color) {
+        clear_color = color;
+        std::fill(color_tile_cleared.begin(), color_tile_cleared.end(), 1);
+    }
+
+    // also resets the stencil bits of d24s8
+    void clear_depth_buffer(float z = 1.0f) {
+        clear_depth_bits = depth_codec::encode(depth, z);
+        std::fill(depth_tile_cleared.begin(), depth_tile_cleared.end(), 1);
+    }
+
+    // writes every sample of the pixel
+    void set_pixel(int x, int y, glm::vec4 pixel_color) {
+        if (x < 0 || x >= width || y < 0 || y >= height)
+            return;
+        touch_color_tile(color_tile(x, y));
+        std::fill_n(color_buffer.begin() + color_index(x, y) * samples, samples, pixel_color);
+    }
+
+    // writes the samples set in mask
+    void set_samples(int x, int y, const glm::vec4 &pixel_color, int mask) {
         if (x < 0 || x >= width || y < 0 || y >= height)
             return;
-        auto pixel_data = buffer_data + y * width * channel + x * channel;
-        auto scale = 1.0f / samples_per_pixel;
+        touch_color_tile(color_tile(x, y));
+        glm::vec4 *pixel = color_buffer.data() + color_index(x, y) * samples;
+        for (int s = 0; s < samples; ++s) {
+            if (mask & (1 << s))
+                pixel[s] = pixel_color;
+        }
+    }
 
-        for (int i = 0; i < channel; ++i) {
-//            auto value = std::pow(scale * pixel_color[i], 1.0f / 2.2f);
-            auto value = pixel_color[i];
-            *pixel_data++ = static_cast<unsigned char>(std::clamp(value * 255.0, 0.0, 255.0));
+    // Copies the linear color, averaged over the samples, into a row major width * height array.
+    void read_linear(glm::vec4 *output) const {
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; x += color_tile_size) {
+                int span = std::min(color_tile_size, width - x);
+                glm::vec4 *dst = output + size_t(y) * width + x;
+                if (color_tile_cleared[color_tile(x, y)]) {
+                    std::fill_n(dst, span, clear_color);
+                    continue;
+                }
+                const glm::vec4 *sample = color_buffer.data() + color_index(x, y) * samples;
+                for (int i = 0; i < span; ++i, sample += samples) {
+                    dst[i] = sample[0];
+                    for (int s = 1; s < samples; ++s)
+                        dst[i] += sample[s];
+                    dst[i] /= float(samples);
+                }
+            }
         }
     }
 
+    // Replaces the color of every pixel, input is a row major width * height array.
+    void write_linear(const glm::vec4 *input) {
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x)
+                set_pixel(x, y, input[size_t(y) * width + x]);
+        }
+    }
+
+    // Converts the linear color buffer into buffer_data: exposure, tonemap, gamma and quantization.
+    // Tiles that were never drawn into after a clear are filled with the clear color resolved once.
+    void resolve() {
+        resolve(buffer_data, false);
+    }
+
+    // Resolves into any width * height * channel buffer, top_down stores the last framebuffer row first.
+    void resolve(unsigned char *output, bool top_down) {
+        unsigned char clear_pixel[4];
+        // also builds the lookup table, after that the resolver is only read and tile rows run in parallel
+        resolver.resolve_pixel(clear_color, clear_pixel, channel, settings);
+        task_group rows;
+        for (int y0 = 0; y0 < height; y0 += color_tile_size)
+            rows.run([this, output, top_down, &clear_pixel, y0] {
+                for (int y = y0; y < std::min(height, y0 + color_tile_size); ++y)
+                    resolve_row(output, top_down, clear_pixel, y);
+            });
+        rows.wait();
+    }
+
+private:
+    // every tile row is contiguous in both layouts, resolve them span by span into the row major output
+    void resolve_row(unsigned char *output, bool top_down, const unsigned char *clear_pixel, int y) {
+        size_t output_row = top_down ? height - 1 - y : y;
+        for (int x = 0; x < width; x += color_tile_size) {
+            int span = std::min(color_tile_size, width - x);
+            unsigned char *dst = output + (output_row * width + x) * channel;
+            if (color_tile_cleared[color_tile(x, y)]) {
+                for (int i = 0; i < span; ++i, dst += channel)
+                    std::copy(clear_pixel, clear_pixel + channel, dst);
+            } else if (samples == 1) {
+                resolver.resolve(color_buffer.data() + color_index(x, y), dst, span, channel, settings);
+            } else {
+                // box filter over the samples, in linear space before the tonemap
+                glm::vec4 averaged[color_tile_size];
+                const glm::vec4 *sample = color_buffer.data() + color_index(x, y) * samples;
+                for (int i = 0; i < span; ++i, sample += samples)
+                    averaged[i] = (sample[0] + sample[1] + sample[2] + sample[3]) * 0.25f;
+                resolver.resolve(averaged, dst, span, channel, settings);
+            }
+        }
+    }
+
+    color_resolver resolver;
+    int color_tiles_x = 0;
+    int depth_tiles_x = 0;
+    glm::vec4 clear_color{0.0f};
+    uint32_t clear_depth_bits = 0;
+    std::vector<unsigned char> color_tile_cleared;
+    std::vector<unsigned char> depth_tile_cleared;
+
+    int color_tile(int x, int y) const {
+        return (y >> color_tile_shift) * color_tiles_x + (x >> color_tile_shift);
+    }
+
+    int depth_stride() const {
+        return depth_codec::bytes_per_texel(depth);
+    }
+
+    unsigned char *depth_texel(int x, int y) {
+        return depth_buffer.data() + depth_index(x, y) * samples * depth_stride();
+    }
+
+    // count pixels starting at pixel index
+    void fill_depth(size_t index, int count) {
+        unsigned char *texel = depth_buffer.data() + index * samples * depth_stride();
+        for (int i = 0; i < count * samples; ++i, texel += depth_stride())
+            depth_codec::store(depth, texel, clear_depth_bits);
+    }
+
+    int depth_tile(int x, int y) const {
+        return (y >> depth_tile_shift) * depth_tiles_x + (x >> depth_tile_shift);
+    }
+
+    void touch_color_tile(int tile) {
+        if (!color_tile_cleared[tile])
+            return;
+        color_tile_cleared[tile] = 0;
+        int x0 = (tile % color_tiles_x) << color_tile_shift;
+        int y0 = (tile / color_tiles_x) << color_tile_shift;
+        if (layout == framebuffer_layout::tiled) {
+            std::fill_n(color_buffer.begin() + color_index(x0, y0) * samples,
+                        color_tile_size * color_tile_size * samples, clear_color);
+            return;
+        }
+        int span = std::min(color_tile_size, width - x0);
+        for (int y = y0; y < std::min(y0 + color_tile_size, height); ++y)
+            std::fill_n(color_buffer.begin() + color_index(x0, y) * samples, span * samples, clear_color);
+    }
+
+    void touch_depth_tile(int tile) {
+        if (!depth_tile_cleared[tile])
+            return;
+        depth_tile_cleared[tile] = 0;
+        int x0 = (tile % depth_tiles_x) << depth_tile_shift;
+        int y0 = (tile / depth_tiles_x) << depth_tile_shift;
+        if (layout == framebuffer_layout::tiled) {
+            fill_depth(depth_index(x0, y0), depth_tile_size * depth_tile_size);
+            return;
+        }
+        int span = std::min(depth_tile_size, width - x0);
+        for (int y = y0; y < std::min(y0 + depth_tile_size, height); ++y)
+            fill_depth(depth_index(x0, y), span);
+    }
 };
 
 #endif //RAYTRACING_FRAMEBUFFER_H
@@ -0,0 +1,121 @@
+#ifndef RAYTRACING_FRUSTUM_H
+#define RAYTRACING_FRUSTUM_H
+
+#include "cmath"
+#include "algorithm"
+#include "glm/glm.hpp"
+
+struct aabb {
+    glm::vec3 min{0.0f};
+    glm::vec3 max{0.0f};
+
+    // contains nothing, expanding it by a point gives that point
+    static aabb none() {
+        return {glm::vec3(INFINITY), glm::vec3(-INFINITY)};
+    }
+
+    bool empty() const {
+        return min.x > max.x || min.y > max.y || min.z > max.z;
+    }
+
+    glm::vec3 center() const {
+        return (min + max) * 0.5f;
+    }
+
+    glm::vec3 extent() const {
+        return max - min;
+    }
+
+    void expand(const glm::vec3 &p) {
+        min = glm::min(min, p);
+        max = glm::max(max, p);
+    }
+
+    void expand(const aabb &box) {
+        min = glm::min(min, box.min);
+        max = glm::max(max, box.max);
+    }
+
+    // Box around the transformed box (Arvo).
+    aabb transformed(const glm::mat4 &m) const {
+        if (empty())
+            return *this;
+        glm::vec3 c = glm::vec3(m * glm::vec4(center(), 1.0f));
+        glm::vec3 half = extent() * 0.5f;
+        glm::vec3 e(0.0f);
+        for (int col = 0; col < 3; ++col)
+            e += glm::abs(glm::vec3(m[col])) * half[col];
+        return {c - e, c + e};
+    }
+};
+
+struct bounding_sphere {
+    glm::vec3 center{0.0f};
+    float radius = 0.0f;
+};
+
+// The six planes of a clip volume, normals point inwards and are unit length so plane distances are
+// real distances in the space the planes live in.
+class frustum {
+public:
+    frustum() = default;
+
+    // Planes of the volume -w <= x, y, z <= w of clip = matrix * p (Gribb and Hartmann). For
+    // projection * view they are in world space, for projection * view * model in object space.
+    explicit frustum(const glm::mat4 &matrix) {
+        glm::mat4 m = glm::transpose(matrix);
+        planes[0] = m[3] + m[0];
+        planes[1] = m[3] - m[0];
+        planes[2] = m[3] + m[1];
+        planes[3] = m[3] - m[1];
+        planes[4] = m[3] + m[2];
+        planes[5] = m[3] - m[2];
+        normalize();
+    }
+
+    // The same volume in the space model maps from.
+    frustum transformed(const glm::mat4 &model) const {
+        frustum result;
+        glm::mat4 transpose = glm::transpose(model);
+        for (int i = 0; i < 6; ++i)
+            result.planes[i] = transpose * planes[i];
+        result.normalize();
+        return result;
+    }
+
+    const glm::vec4 &get_plane(int i) const {
+        return planes[i];
+    }
+
+    bool intersects(const bounding_sphere &sphere) const {
+        for (const auto &plane: planes)
+            if (glm::dot(glm::vec3(plane), sphere.center) + plane.w < -sphere.radius)
+                return false;
+        return true;
+    }
+
+    // Conservative, a box near a frustum corner may pass although it is outside.
+    bool intersects(const aabb &box) const {
+        for (const auto &plane: planes) {
+            // the corner furthest along the plane normal
+            glm::vec3 corner(plane.x >= 0.0f ? box.max.x : box.min.x, plane.y >= 0.0f ? box.max.y : box.min.y,
+                             plane.z >= 0.0f ? box.max.z : box.min.z);
+            if (glm::dot(glm::vec3(plane), corner) + plane.w < 0.0f)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    glm::vec4 planes[6];
+
+    void normalize() {
+        for (auto &plane: planes) {
+            float length = glm::length(glm::vec3(plane));
+            if (length > 0.0f)
+                plane /= length;
+        }
+    }
+};
+
+#endif //RAYTRACING_FRUSTUM_H
@@ -0,0 +1,86 @@
+#ifndef RAYTRACING_GEOMETRY_ARENA_H
+#define RAYTRACING_GEOMETRY_ARENA_H
+
+#include "vector"
+#include "memory"
+#include "cstring"
+#include "cstdint"
+#include "algorithm"
+#include "array_view.h"
+
+// Bump allocator for the geometry of a model. Vertex streams, indices, meshlets and levels of detail are
+// placed one after another in large blocks, in the order they are written, so drawing the meshes walks
+// memory front to back. Nothing is freed before the arena.
+class geometry_arena {
+public:
+    static constexpr size_t default_block_size = size_t(1) << 20;
+    // cache line, also what the mesh cache aligns its arrays to
+    static constexpr size_t alignment = 64;
+
+    explicit geometry_arena(size_t _block_size = default_block_size) : block_size(_block_size) {}
+
+    geometry_arena(const geometry_arena &) = delete;
+
+    geometry_arena &operator=(const geometry_arena &) = delete;
+
+    // Uninitialized and aligned, valid as long as the arena.
+    template<class T>
+    T *allocate(size_t count) {
+        size_t bytes = std::max<size_t>(count * sizeof(T), 1);
+        if (blocks.empty() || blocks.back().used + bytes > blocks.back().size)
+            add_block(bytes);
+        block &current = blocks.back();
+        T *result = reinterpret_cast<T *>(current.data + current.used);
+        current.used = align(current.used + bytes);
+        used += bytes;
+        return result;
+    }
+
+    template<class T>
+    array_view<const T> copy(const std::vector<T> &source) {
+        T *target = allocate<T>(source.size());
+        if (!source.empty())
+            std::memcpy(target, source.data(), source.size() * sizeof(T));
+        return array_view<const T>(target, source.size());
+    }
+
+    // bytes handed out and bytes held
+    size_t get_used() const {
+        return used;
+    }
+
+    size_t get_capacity() const {
+        size_t capacity = 0;
+        for (const auto &b: blocks)
+            capacity += b.size;
+        return capacity;
+    }
+
+private:
+    struct block {
+        std::unique_ptr<unsigned char[]> memory;
+        unsigned char *data;
+        size_t size;
+        size_t used;
+    };
+
+    std::vector<block> blocks;
+    size_t block_size;
+    size_t used = 0;
+
+    static size_t align(size_t offset) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    void add_block(size_t bytes) {
+        block b;
+        b.size = std::max(block_size, align(bytes));
+        b.memory.reset(new unsigned char[b.size + alignment]);
+        auto address = reinterpret_cast<uintptr_t>(b.memory.get());
+        b.data = b.memory.get() + (align(address) - address);
+        b.used = 0;
+        blocks.push_back(std::move(b));
+    }
+};
+
+#endif //RAYTRACING_GEOMETRY_ARENA_H
@@ -0,0 +1,636 @@
+#ifndef RAYTRACING_IMAGE_WRITER_H
+#define RAYTRACING_IMAGE_WRITER_H
+
+#include "string"
+#include "vector"
+#include "fstream"
+#include "iostream"
+#include "algorithm"
+#include "cstdlib"
+#include "cstdint"
+#include "future"
+#include "deque"
+#include "memory"
+#include "functional"
+#include "task_scheduler.h"
+
+#ifdef MINIRENDER_HAS_ZLIB
+#include <zlib.h>
+#endif
+
+enum class image_format {
+    png,
+    qoi,
+    ppm,
+    // bare pixels, described by a json sidecar next to the file
+    raw
+};
+
+// 8 bit image, rows stored top to bottom.
+struct image {
+    int width = 0;
+    int height = 0;
+    int channel = 0;
+    std::vector<unsigned char> pixels;
+
+    image() = default;
+
+    image(int w, int h, int c) : width(w), height(h), channel(c), pixels(size_t(w) * h * c) {}
+
+    unsigned char *row(int y) {
+        return pixels.data() + size_t(y) * width * channel;
+    }
+
+    const unsigned char *row(int y) const {
+        return pixels.data() + size_t(y) * width * channel;
+    }
+};
+
+class image_writer {
+public:
+    // Format from the file extension, png for anything unknown.
+    static image_format format_from_path(const std::string &path) {
+        std::string extension = path.substr(std::min(path.size(), path.find_last_of('.') + 1));
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+        if (extension == "qoi")
+            return image_format::qoi;
+        if (extension == "ppm" || extension == "pgm")
+            return image_format::ppm;
+        if (extension == "raw")
+            return image_format::raw;
+        return image_format::png;
+    }
+
+    static bool write(const std::string &path, const image &img) {
+        return write(path, img, format_from_path(path));
+    }
+
+    static bool write(const std::string &path, const image &img, image_format format) {
+        bool ok = false;
+        switch (format) {
+            case image_format::png:
+                ok = write_png(path, img);
+                break;
+            case image_format::qoi:
+                ok = write_qoi(path, img);
+                break;
+            case image_format::ppm:
+                ok = write_ppm(path, img);
+                break;
+            case image_format::raw:
+                ok = write_raw(path, img);
+                break;
+        }
+        if (!ok)
+            std::cerr << "ERROR: Could not write image file '" << path << "'.\n";
+        return ok;
+    }
+
+    // With zlib the image is split into row bands that are filtered and deflated in parallel on the
+    // task scheduler, then stitched into a single zlib stream. Without it this is stbi_write_png.
+    static bool write_png(const std::string &path, const image &img) {
+#ifdef MINIRENDER_HAS_ZLIB
+        const size_t row_bytes = size_t(img.width) * img.channel;
+        const int band_count = std::clamp(img.height / min_band_rows, 1,
+                                          static_cast<int>(task_scheduler::instance().size()) * 2);
+        const int band_rows = (img.height + band_count - 1) / band_count;
+
+        struct band {
+            std::vector<unsigned char> deflated;
+            uLong adler = 1;
+            size_t filtered_bytes = 0;
+        };
+        std::vector<task_future<band>> bands;
+        for (int y0 = 0; y0 < img.height; y0 += band_rows) {
+            int y1 = std::min(img.height, y0 + band_rows);
+            bands.push_back(task_scheduler::instance().submit([&img, row_bytes, y0, y1] {
+                band result;
+                std::vector<unsigned char> filtered((row_bytes + 1) * (y1 - y0));
+                std::vector<unsigned char> scratch(row_bytes * 5);
+                const std::vector<unsigned char> zero_row(row_bytes);
+                for (int y = y0; y < y1; ++y)
+                    filter_row(img.row(y), y > 0 ? img.row(y - 1) : zero_row.data(), row_bytes, img.channel,
+                               scratch.data(), filtered.data() + (row_bytes + 1) * (y - y0));
+                result.filtered_bytes = filtered.size();
+                result.adler = adler32(1, filtered.data(), static_cast<uInt>(filtered.size()));
+                result.deflated = deflate_band(filtered, y1 == img.height);
+                return result;
+            }));
+        }
+
+        // 0x78 0x9c is the zlib header for a 32k window and default compression
+        std::vector<unsigned char> idat = {0x78, 0x9c};
+        uLong adler = 1;
+        for (auto &pending: bands) {
+            // encoder jobs run on the workers too, a band no worker has started yet is deflated here
+            band result = task_scheduler::instance().wait(pending);
+            if (result.deflated.empty())
+                return false;
+            idat.insert(idat.end(), result.deflated.begin(), result.deflated.end());
+            adler = adler32_combine(adler, result.adler, static_cast<z_off_t>(result.filtered_bytes));
+        }
+        put_u32_be(idat, static_cast<uint32_t>(adler));
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        write_png_header(out, img.width, img.height, img.channel);
+        write_png_chunk(out, "IDAT", idat.data(), idat.size());
+        write_png_chunk(out, "IEND", nullptr, 0);
+        return bool(out);
+#else
+        stbi_flip_vertically_on_write(false);
+        return stbi_write_png(path.c_str(), img.width, img.height, img.channel, img.pixels.data(), 0) != 0;
+#endif
+    }
+
+    // https://qoiformat.org/qoi-specification.pdf, one and two channel images are widened to rgb(a).
+    static bool write_qoi(const std::string &path, const image &img) {
+        const int channels = img.channel == 2 || img.channel == 4 ? 4 : 3;
+        std::vector<unsigned char> bytes = {'q', 'o', 'i', 'f'};
+        bytes.reserve(size_t(img.width) * img.height * (channels + 1) + 22);
+        put_u32_be(bytes, img.width);
+        put_u32_be(bytes, img.height);
+        bytes.push_back(static_cast<unsigned char>(channels));
+        bytes.push_back(0);
+
+        struct rgba {
+            unsigned char r, g, b, a;
+
+            bool operator==(const rgba &o) const {
+                return r == o.r && g == o.g && b == o.b && a == o.a;
+            }
+        };
+        rgba index[64] = {};
+        rgba previous = {0, 0, 0, 255};
+        int run = 0;
+        const size_t pixel_count = size_t(img.width) * img.height;
+        for (size_t i = 0; i < pixel_count; ++i) {
+            const unsigned char *p = img.pixels.data() + i * img.channel;
+            rgba pixel;
+            if (img.channel >= 3)
+                pixel = {p[0], p[1], p[2], img.channel == 4 ? p[3] : static_cast<unsigned char>(255)};
+            else
+                pixel = {p[0], p[0], p[0], img.channel == 2 ? p[1] : static_cast<unsigned char>(255)};
+
+            if (pixel == previous) {
+                if (++run == 62 || i + 1 == pixel_count) {
+                    bytes.push_back(static_cast<unsigned char>(0xc0 | (run - 1)));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                bytes.push_back(static_cast<unsigned char>(0xc0 | (run - 1)));
+                run = 0;
+            }
+
+            int hash = (pixel.r * 3 + pixel.g * 5 + pixel.b * 7 + pixel.a * 11) % 64;
+            if (index[hash] == pixel) {
+                bytes.push_back(static_cast<unsigned char>(hash));
+            } else if (pixel.a == previous.a) {
+                index[hash] = pixel;
+                int dr = static_cast<signed char>(pixel.r - previous.r);
+                int dg = static_cast<signed char>(pixel.g - previous.g);
+                int db = static_cast<signed char>(pixel.b - previous.b);
+                int dr_dg = dr - dg;
+                int db_dg = db - dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    bytes.push_back(static_cast<unsigned char>(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+                } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                    bytes.push_back(static_cast<unsigned char>(0x80 | (dg + 32)));
+                    bytes.push_back(static_cast<unsigned char>((dr_dg + 8) << 4 | (db_dg + 8)));
+                } else {
+                    bytes.insert(bytes.end(), {0xfe, pixel.r, pixel.g, pixel.b});
+                }
+            } else {
+                index[hash] = pixel;
+                bytes.insert(bytes.end(), {0xff, pixel.r, pixel.g, pixel.b, pixel.a});
+            }
+            previous = pixel;
+        }
+        bytes.insert(bytes.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+        return bool(out);
+    }
+
+    // Binary P6 for color and P5 for gray images, alpha is dropped.
+    static bool write_ppm(const std::string &path, const image &img) {
+        const bool gray = img.channel < 3;
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out << (gray ? "P5\n" : "P6\n") << img.width << ' ' << img.height << "\n255\n";
+        if (img.channel == 1 || img.channel == 3) {
+            out.write(reinterpret_cast<const char *>(img.pixels.data()), img.pixels.size());
+        } else {
+            const int kept = gray ? 1 : 3;
+            std::vector<unsigned char> row(size_t(img.width) * kept);
+            for (int y = 0; y < img.height; ++y) {
+                const unsigned char *src = img.row(y);
+                for (int x = 0; x < img.width; ++x)
+                    std::copy(src + x * img.channel, src + x * img.channel + kept, row.begin() + x * kept);
+                out.write(reinterpret_cast<const char *>(row.data()), row.size());
+            }
+        }
+        return bool(out);
+    }
+
+    // The pixels as they are, with the layout in "<path>.json".
+    static bool write_raw(const std::string &path, const image &img) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(img.pixels.data()), img.pixels.size());
+        std::ofstream sidecar(path + ".json", std::ios::trunc);
+        sidecar << "{\"width\": " << img.width << ", \"height\": " << img.height << ", \"channel\": "
+                << img.channel << ", \"type\": \"uint8\", \"rows\": \"top_down\"}\n";
+        return out && sidecar;
+    }
+
+private:
+    friend class png_row_writer;
+
+    static constexpr int min_band_rows = 32;
+
+    static void put_u32_be(std::vector<unsigned char> &bytes, uint32_t value) {
+        bytes.insert(bytes.end(), {static_cast<unsigned char>(value >> 24), static_cast<unsigned char>(value >> 16),
+                                   static_cast<unsigned char>(value >> 8), static_cast<unsigned char>(value)});
+    }
+
+#ifdef MINIRENDER_HAS_ZLIB
+
+    static int paeth(int a, int b, int c) {
+        int p = a + b - c;
+        int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        if (pa <= pb && pa <= pc)
+            return a;
+        return pb <= pc ? b : c;
+    }
+
+    // Tries all five png filters and keeps the one with the smallest sum of absolute residuals.
+    static void filter_row(const unsigned char *row, const unsigned char *previous, size_t bytes, int bpp,
+                           unsigned char *scratch, unsigned char *out) {
+        int best = 0;
+        long best_cost = -1;
+        for (int filter = 0; filter < 5; ++filter) {
+            unsigned char *candidate = scratch + bytes * filter;
+            long cost = 0;
+            for (size_t i = 0; i < bytes; ++i) {
+                int a = i >= size_t(bpp) ? row[i - bpp] : 0;
+                int b = previous[i];
+                int c = i >= size_t(bpp) ? previous[i - bpp] : 0;
+                int predicted = 0;
+                switch (filter) {
+                    case 1: predicted = a; break;
+                    case 2: predicted = b; break;
+                    case 3: predicted = (a + b) >> 1; break;
+                    case 4: predicted = paeth(a, b, c); break;
+                }
+                candidate[i] = static_cast<unsigned char>(row[i] - predicted);
+                cost += std::abs(static_cast<signed char>(candidate[i]));
+            }
+            if (best_cost < 0 || cost < best_cost) {
+                best = filter;
+                best_cost = cost;
+            }
+        }
+        out[0] = static_cast<unsigned char>(best);
+        std::copy(scratch + bytes * best, scratch + bytes * (best + 1), out + 1);
+    }
+
+    // Raw deflate of one band. Every band but the last ends on a byte aligned sync flush, so the bands
+    // concatenate into one valid stream.
+    static std::vector<unsigned char> deflate_band(std::vector<unsigned char> &filtered, bool last) {
+        z_stream stream{};
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return {};
+        std::vector<unsigned char> out(deflateBound(&stream, filtered.size()) + 16);
+        stream.next_in = filtered.data();
+        stream.avail_in = static_cast<uInt>(filtered.size());
+        stream.next_out = out.data();
+        stream.avail_out = static_cast<uInt>(out.size());
+        int status;
+        do {
+            if (stream.avail_out == 0) {
+                size_t used = out.size();
+                out.resize(used * 2);
+                stream.next_out = out.data() + used;
+                stream.avail_out = static_cast<uInt>(out.size() - used);
+            }
+            status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+        } while (status == Z_OK && (last || stream.avail_in != 0 || stream.avail_out == 0));
+        bool ok = last ? status == Z_STREAM_END : status == Z_OK;
+        out.resize(ok ? stream.total_out : 0);
+        deflateEnd(&stream);
+        return out;
+    }
+
+    static void write_png_chunk(std::ofstream &out, const char *type, const unsigned char *data, size_t size) {
+        std::vector<unsigned char> header;
+        put_u32_be(header, static_cast<uint32_t>(size));
+        header.insert(header.end(), type, type + 4);
+        uLong crc = crc32(0, header.data() + 4, 4);
+        if (size > 0)
+            crc = crc32(crc, data, static_cast<uInt>(size));
+        std::vector<unsigned char> trailer;
+        put_u32_be(trailer, static_cast<uint32_t>(crc));
+        out.write(reinterpret_cast<const char *>(header.data()), header.size());
+        out.write(reinterpret_cast<const char *>(data), size);
+        out.write(reinterpret_cast<const char *>(trailer.data()), trailer.size());
+    }
+
+    static void write_png_header(std::ofstream &out, int width, int height, int channel) {
+        static const unsigned char signature[] = {137, 80, 78, 71, 13, 10, 26, 10};
+        static const unsigned char color_types[] = {0, 0, 4, 2, 6};
+        out.write(reinterpret_cast<const char *>(signature), sizeof(signature));
+        std::vector<unsigned char> ihdr;
+        put_u32_be(ihdr, width);
+        put_u32_be(ihdr, height);
+        ihdr.insert(ihdr.end(), {8, color_types[channel], 0, 0, 0});
+        write_png_chunk(out, "IHDR", ihdr.data(), ihdr.size());
+    }
+
+#endif
+};
+
+// Uncompressed YUV4MPEG2 stream, frames are converted to full range BT.601 4:2:0 (C420jpeg).
+class y4m_writer {
+public:
+    y4m_writer(const std::string &path, int w, int h, int fps) : out(path, std::ios::binary | std::ios::trunc),
+                                                                  width(w), height(h),
+                                                                  chroma_width((w + 1) / 2),
+                                                                  chroma_height((h + 1) / 2),
+                                                                  planes(size_t(w) * h +
+                                                                         size_t(chroma_width) * chroma_height * 2) {
+        out << "YUV4MPEG2 W" << width << " H" << height << " F" << fps << ":1 Ip A1:1 C420jpeg\n";
+    }
+
+    bool is_open() const {
+        return bool(out);
+    }
+
+    bool write_frame(const image &frame) {
+        if (frame.width != width || frame.height != height)
+            return false;
+        unsigned char *luma = planes.data();
+        unsigned char *cb = luma + size_t(width) * height;
+        unsigned char *cr = cb + size_t(chroma_width) * chroma_height;
+        for (int y = 0; y < height; ++y) {
+            const unsigned char *src = frame.row(y);
+            for (int x = 0; x < width; ++x, src += frame.channel) {
+                int r = src[0], g = src[frame.channel >= 3 ? 1 : 0], b = src[frame.channel >= 3 ? 2 : 0];
+                luma[size_t(y) * width + x] = static_cast<unsigned char>((77 * r + 150 * g + 29 * b + 128) >> 8);
+            }
+        }
+        // chroma from the average of each 2x2 block
+        for (int cy = 0; cy < chroma_height; ++cy) {
+            for (int cx = 0; cx < chroma_width; ++cx) {
+                int r = 0, g = 0, b = 0, count = 0;
+                for (int y = cy * 2; y < std::min(height, cy * 2 + 2); ++y) {
+                    for (int x = cx * 2; x < std::min(width, cx * 2 + 2); ++x) {
+                        const unsigned char *src = frame.row(y) + x * frame.channel;
+                        r += src[0];
+                        g += src[frame.channel >= 3 ? 1 : 0];
+                        b += src[frame.channel >= 3 ? 2 : 0];
+                        ++count;
+                    }
+                }
+                size_t index = size_t(cy) * chroma_width + cx;
+                cb[index] = static_cast<unsigned char>(
+                        std::clamp(128 + (-43 * r - 85 * g + 128 * b) / (256 * count), 0, 255));
+                cr[index] = static_cast<unsigned char>(
+                        std::clamp(128 + (128 * r - 107 * g - 21 * b) / (256 * count), 0, 255));
+            }
+        }
+        out << "FRAME\n";
+        out.write(reinterpret_cast<const char *>(planes.data()), planes.size());
+        return bool(out);
+    }
+
+private:
+    std::ofstream out;
+    int width;
+    int height;
+    int chroma_width;
+    int chroma_height;
+    std::vector<unsigned char> planes;
+};
+
+// Receives an image one row at a time, top row first, for images too large to hold in memory.
+class row_writer {
+public:
+    virtual ~row_writer() = default;
+
+    virtual bool write_row(const unsigned char *row) = 0;
+
+    // Completes the file, false if anything failed or not every row was written.
+    virtual bool finish() = 0;
+
+    // png or ppm by extension, nullptr if the format cannot be streamed or the file cannot be opened.
+    static std::unique_ptr<row_writer> open(const std::string &path, int width, int height, int channel);
+};
+
+class ppm_row_writer : public row_writer {
+public:
+    ppm_row_writer(const std::string &path, int w, int h, int c) : out(path, std::ios::binary | std::ios::trunc),
+                                                                    width(w), height(h), channel(c),
+                                                                    packed(size_t(w) * (c < 3 ? 1 : 3)) {
+        out << (c < 3 ? "P5\n" : "P6\n") << width << ' ' << height << "\n255\n";
+    }
+
+    bool is_open() const {
+        return bool(out);
+    }
+
+    bool write_row(const unsigned char *row) override {
+        if (channel == 1 || channel == 3) {
+            out.write(reinterpret_cast<const char *>(row), packed.size());
+        } else {
+            const int kept = channel < 3 ? 1 : 3;
+            for (int x = 0; x < width; ++x)
+                std::copy(row + x * channel, row + x * channel + kept, packed.begin() + x * kept);
+            out.write(reinterpret_cast<const char *>(packed.data()), packed.size());
+        }
+        ++rows;
+        return bool(out);
+    }
+
+    bool finish() override {
+        out.close();
+        return rows == height && bool(out);
+    }
+
+private:
+    std::ofstream out;
+    int width;
+    int height;
+    int channel;
+    int rows = 0;
+    std::vector<unsigned char> packed;
+};
+
+#ifdef MINIRENDER_HAS_ZLIB
+
+// Filters and deflates each row as it arrives and writes IDAT chunks whenever the output buffer
+// fills, memory use is a couple of rows plus the deflate window.
+class png_row_writer : public row_writer {
+public:
+    png_row_writer(const std::string &path, int w, int h, int c) : out(path, std::ios::binary | std::ios::trunc),
+                                                                    height(h), channel(c),
+                                                                    row_bytes(size_t(w) * c),
+                                                                    previous(row_bytes), filtered(row_bytes + 1),
+                                                                    scratch(row_bytes * 5), chunk(1 << 16) {
+        image_writer::write_png_header(out, w, h, c);
+        deflating = deflateInit(&stream, Z_DEFAULT_COMPRESSION) == Z_OK;
+        stream.next_out = chunk.data();
+        stream.avail_out = static_cast<uInt>(chunk.size());
+    }
+
+    ~png_row_writer() override {
+        if (deflating)
+            deflateEnd(&stream);
+    }
+
+    bool is_open() const {
+        return deflating && bool(out);
+    }
+
+    bool write_row(const unsigned char *row) override {
+        image_writer::filter_row(row, previous.data(), row_bytes, channel, scratch.data(), filtered.data());
+        std::copy(row, row + row_bytes, previous.begin());
+        ++rows;
+        stream.next_in = filtered.data();
+        stream.avail_in = static_cast<uInt>(filtered.size());
+        while (stream.avail_in != 0) {
+            if (deflate(&stream, Z_NO_FLUSH) != Z_OK)
+                return false;
+            if (stream.avail_out == 0)
+                flush_chunk();
+        }
+        return bool(out);
+    }
+
+    bool finish() override {
+        int status;
+        while ((status = deflate(&stream, Z_FINISH)) == Z_OK)
+            flush_chunk();
+        flush_chunk();
+        image_writer::write_png_chunk(out, "IEND", nullptr, 0);
+        out.close();
+        return status == Z_STREAM_END && rows == height && bool(out);
+    }
+
+private:
+    std::ofstream out;
+    int height;
+    int channel;
+    int rows = 0;
+    size_t row_bytes;
+    std::vector<unsigned char> previous;
+    std::vector<unsigned char> filtered;
+    std::vector<unsigned char> scratch;
+    std::vector<unsigned char> chunk;
+    z_stream stream{};
+    bool deflating = false;
+
+    void flush_chunk() {
+        size_t used = chunk.size() - stream.avail_out;
+        if (used > 0)
+            image_writer::write_png_chunk(out, "IDAT", chunk.data(), used);
+        stream.next_out = chunk.data();
+        stream.avail_out = static_cast<uInt>(chunk.size());
+    }
+};
+
+#endif
+
+inline std::unique_ptr<row_writer> row_writer::open(const std::string &path, int width, int height, int channel) {
+    switch (image_writer::format_from_path(path)) {
+        case image_format::ppm: {
+            auto writer = std::make_unique<ppm_row_writer>(path, width, height, channel);
+            if (writer->is_open())
+                return writer;
+            break;
+        }
+        case image_format::png: {
+#ifdef MINIRENDER_HAS_ZLIB
+            auto writer = std::make_unique<png_row_writer>(path, width, height, channel);
+            if (writer->is_open())
+                return writer;
+#else
+            std::cerr << "ERROR: Streaming png output needs zlib, use a .ppm path instead.\n";
+            return nullptr;
+#endif
+            break;
+        }
+        default:
+            std::cerr << "ERROR: Only png and ppm output can be written row by row.\n";
+            return nullptr;
+    }
+    std::cerr << "ERROR: Could not open image file '" << path << "'.\n";
+    return nullptr;
+}
+
+// Runs image_writer on the task scheduler, so the render thread only pays for a copy of the frame.
+// At most max_in_flight images are queued, submit() waits for the oldest one beyond that.
+class image_encoder {
+public:
+    static image_encoder &instance() {
+        static image_encoder encoder;
+        return encoder;
+    }
+
+    ~image_encoder() {
+        wait();
+    }
+
+    void set_max_in_flight(size_t count) {
+        max_in_flight = std::max<size_t>(1, count);
+    }
+
+    void submit(const std::string &path, image img) {
+        auto shared_img = std::make_shared<image>(std::move(img));
+        submit([path, shared_img] { return image_writer::write(path, *shared_img); });
+    }
+
+    // Any encode step returning false on failure. Jobs run one at a time in submission order, each
+    // depends on the one before, so frames of a stream can be submitted one by one.
+    void submit(std::function<bool()> job) {
+        while (in_flight.size() >= max_in_flight)
+            finish_oldest();
+        pending_job next{std::make_unique<task_group>(scheduler), std::make_shared<bool>(false)};
+        auto run = [job = std::move(job), ok = next.ok] { *ok = job(); };
+        if (in_flight.empty())
+            next.group->run(std::move(run));
+        else
+            next.group->run_after(*in_flight.back().group, std::move(run));
+        in_flight.push_back(std::move(next));
+    }
+
+    // Blocks until everything submitted so far is written, false if any write failed.
+    bool wait() {
+        bool ok = true;
+        while (!in_flight.empty())
+            ok = finish_oldest() && ok;
+        return ok;
+    }
+
+private:
+    struct pending_job {
+        std::unique_ptr<task_group> group;
+        std::shared_ptr<bool> ok;
+    };
+
+    size_t max_in_flight = 2;
+    // jobs run on the shared scheduler, construct it first so it outlives the encoder at exit
+    task_scheduler &scheduler = task_scheduler::instance();
+    std::deque<pending_job> in_flight;
+
+    image_encoder() = default;
+
+    bool finish_oldest() {
+        in_flight.front().group->wait();
+        bool ok = *in_flight.front().ok;
+        in_flight.pop_front();
+        return ok;
+    }
+};
+
+#endif //RAYTRACING_IMAGE_WRITER_H
@@ -0,0 +1,84 @@
+#ifndef RAYTRACING_MAPPED_FILE_H
+#define RAYTRACING_MAPPED_FILE_H
+
+#include "string"
+#include "memory"
+#include "fstream"
+#include "algorithm"
+#include "functional"
+#include "thread"
+#include "cstdio"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Read only, shared mapping of a whole file. Pages are faulted in on first access and shared with
+// every other process mapping the same file.
+class mapped_file {
+public:
+    static std::shared_ptr<mapped_file> open(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+        struct stat info{};
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return nullptr;
+        }
+        void *address = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (address == MAP_FAILED)
+            return nullptr;
+        return std::shared_ptr<mapped_file>(new mapped_file(address, info.st_size));
+    }
+
+    // Writes through a temporary file and renames it into place, so concurrent readers never see a
+    // partially written file.
+    static bool write_atomically(const std::string &path, const std::function<bool(std::ofstream &)> &writer) {
+        std::string temp_path = path + ".tmp." + std::to_string(getpid()) + "." +
+                                std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+        bool ok = out && writer(out);
+        out.close();
+        if (!ok || !out || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    ~mapped_file() {
+        munmap(address, length);
+    }
+
+    mapped_file(const mapped_file &) = delete;
+
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    const unsigned char *data() const {
+        return static_cast<const unsigned char *>(address);
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    // Drops the pages of [offset, offset + bytes) from this process, they are faulted in again from
+    // the page cache on the next access.
+    void release(size_t offset, size_t bytes) const {
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t begin = (offset + page - 1) / page * page;
+        size_t end = std::min(offset + bytes, length) / page * page;
+        if (end > begin)
+            madvise(static_cast<char *>(address) + begin, end - begin, MADV_DONTNEED);
+    }
+
+private:
+    void *address;
+    size_t length;
+
+    mapped_file(void *_address, size_t _length) : address(_address), length(_length) {}
+};
+
+#endif //RAYTRACING_MAPPED_FILE_H
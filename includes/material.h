@@ -8,15 +8,15 @@ public:
     glm::vec4 albedo_value{};
     float shininess = 32.0f;
 
-    virtual glm::vec4 get_diffuse(double u, double v) const {
+    virtual glm::vec4 get_diffuse(double, double, float = 0.0f) const {
         return albedo_value;
     }
 
-    virtual glm::vec4 get_specular(double u, double v) const {
+    virtual glm::vec4 get_specular(double, double, float = 0.0f) const {
         return glm::vec4(0.0f);
     }
 
-    virtual glm::vec4 get_normal(double u, double v) const {
+    virtual glm::vec4 get_normal(double, double, float = 0.0f) const {
         return glm::vec4(0.0f);
     }
 };
@@ -36,22 +36,22 @@ public:
     lambertian(shared_ptr<texture> _diffuse, shared_ptr<texture> _specular, shared_ptr<texture> _normal) : diffuse(
             _diffuse), specular(_specular), normal(_normal) {}
 
-    virtual glm::vec4 get_specular(double u, double v) const override {
+    virtual glm::vec4 get_specular(double u, double v, float texel_footprint = 0.0f) const override {
         if (specular == nullptr)
             return glm::vec4(0.0f);
-        return specular->get_value(u, v);
+        return specular->get_value(u, v, texel_footprint);
     }
 
-    virtual glm::vec4 get_diffuse(double u, double v) const override {
+    virtual glm::vec4 get_diffuse(double u, double v, float texel_footprint = 0.0f) const override {
         if (diffuse == nullptr)
             return glm::vec4(0.0f);
-        return diffuse->get_value(u, v);
+        return diffuse->get_value(u, v, texel_footprint);
     }
 
-    virtual glm::vec4 get_normal(double u, double v) const override {
+    virtual glm::vec4 get_normal(double u, double v, float texel_footprint = 0.0f) const override {
         if (normal == nullptr)
             return glm::vec4(0.0f);
-        return normal->get_value(u, v);;
+        return normal->get_value(u, v, texel_footprint);;
     }
 };
 
@@ -4,36 +4,127 @@
 #include "vertex.h"
 #include "material.h"
 #include "rasterizer.h"
+#include "array_view.h"
+#include "geometry_arena.h"
+#include "vertex_streams.h"
+#include "mesh_optimizer.h"
+#include "meshlet.h"
+#include "mesh_lod.h"
 
 class mesh {
 public:
-    // mesh Data
-    vector<vertex> vertices;
-    vector<unsigned int> indices;
+    // mesh Data, views into a geometry arena or into a mapped mesh cache file
+    vertex_streams vertices;
+    array_view<const unsigned int> indices;
+    array_view<const meshlet> meshlets;
+    // at least one, the first covers every meshlet of the full mesh
+    array_view<const mesh_lod> lods;
     shared_ptr<material> _material;
+    // object space bounds
+    aabb bounds;
+    bounding_sphere sphere;
 
-    // constructor
-    mesh(vector<vertex> vertices, vector<unsigned int> indices, shared_ptr<material> _mat) : _material(
-            _mat) {
-        this->vertices = vertices;
-        this->indices = indices;
+    // constructor, packs the given attributes of vertices into their streams in arena, which the mesh
+    // keeps alive, and copies the indices, meshlets and lods there after them. Those three are only read,
+    // move them in so they are freed once the mesh is built. Without meshlets the triangles are
+    // partitioned here, which reorders them, and without lods the mesh has a single level of detail.
+    mesh(const shared_ptr<geometry_arena> &arena, const vector<vertex> &vertices, vector<unsigned int> indices,
+         shared_ptr<material> _mat, uint32_t attributes = all_vertex_attributes,
+         const vertex_streams::encoding &encoding = {}, vector<meshlet> meshlets = {}, vector<mesh_lod> lods = {}) :
+            _material(_mat), storage(arena) {
+        if (meshlets.empty())
+            meshlets = partition_meshlets(vertices, indices);
+        if (lods.empty())
+            lods.push_back({0, static_cast<uint32_t>(meshlets.size()), static_cast<uint32_t>(indices.size() / 3),
+                            0.0f});
+        vertex_streams::encode(vertices, attributes, encoding, *arena, this->vertices);
+        compute_meshlet_bounds(this->vertices, indices, meshlets);
+        this->indices = arena->copy(indices);
+        this->meshlets = arena->copy(meshlets);
+        this->lods = arena->copy(lods);
+        compute_bounds();
+    }
+
+    // A mesh with an arena of its own, sized to it.
+    mesh(const vector<vertex> &vertices, vector<unsigned int> indices, shared_ptr<material> _mat,
+         uint32_t attributes = all_vertex_attributes, const vertex_streams::encoding &encoding = {},
+         vector<meshlet> meshlets = {}, vector<mesh_lod> lods = {}) :
+            mesh(make_shared<geometry_arena>(0), vertices, std::move(indices), std::move(_mat), attributes,
+                 encoding, std::move(meshlets), std::move(lods)) {}
+
+    // keepalive holds whatever the views point into
+    mesh(const vertex_streams &vertices, array_view<const unsigned int> indices, array_view<const meshlet> meshlets,
+         array_view<const mesh_lod> lods, shared_ptr<const void> keepalive, shared_ptr<material> _mat) :
+            vertices(vertices), indices(indices), meshlets(meshlets), lods(lods), _material(_mat),
+            storage(std::move(keepalive)) {
+        compute_bounds();
     }
 
     // render the mesh
     void draw(rasterizer &raster) {
-        for (int i = 0; i < indices.size(); i += 3) {
-            vertex p1, p2, p3;
-            p1 = vertices[indices[i]];
-            p2 = vertices[indices[i + 1]];
-            p3 = vertices[indices[i + 2]];
-            raster.set_material(_material);
-            raster.render_triangle(p1, p2, p3);
-//            raster.wireframe_triangle(p1, p2, p3);
+        raster.set_material(_material);
+        // meshlets outside the frustum or facing away are skipped before any vertex is transformed
+        for_each_triangle(raster.get_meshlet_culler(), raster.get_vertex_attributes(), raster.get_lod_scale(),
+                          raster.get_lod_threshold(), [&](const vertex &v) { return raster.transform_vertex(v); },
+                          [&](const vertex2fragment &o1, const vertex2fragment &o2, const vertex2fragment &o3) {
+                              raster.render_transformed_triangle(o1, o2, o3);
+//                              raster.wireframe_triangle(p1, p2, p3);
+                          });
+    }
+
+    // The geometry half of draw: passes every triangle of the meshlets culler lets through, at the level of
+    // detail the lod arguments select, to emit(o1, o2, o3), with the vertices run through transform(v).
+    // Only the given attributes are fetched. Touches nothing but its arguments, so it can run on any thread.
+    // The meshlets of the level can be split into slice_count runs of about equal length, then only run
+    // slice is drawn.
+    template<class Transform, class Emit>
+    void for_each_triangle(const meshlet_culler &culler, uint32_t attributes, float lod_scale, float lod_threshold,
+                           Transform &&transform_vertex, Emit &&emit, uint32_t slice = 0,
+                           uint32_t slice_count = 1) const {
+        // fifo post transform cache, the import pass orders triangles for it
+        unsigned int tags[mesh_optimizer::cache_size];
+        vertex2fragment transformed[mesh_optimizer::cache_size];
+        std::fill(std::begin(tags), std::end(tags), ~0u);
+        int next = 0;
+        auto transform = [&](unsigned int index) {
+            for (int i = 0; i < mesh_optimizer::cache_size; ++i)
+                if (tags[i] == index)
+                    return transformed[i];
+            vertex v(glm::vec3(0.0f));
+            vertices.fetch(index, attributes, v);
+            tags[next] = index;
+            transformed[next] = transform_vertex(v);
+            const vertex2fragment &result = transformed[next];
+            next = (next + 1) % mesh_optimizer::cache_size;
+            return result;
+        };
+
+        const mesh_lod &lod = lods[select_lod(lods, sphere, culler.get_eye(), lod_scale, lod_threshold)];
+        const uint32_t first = lod.first_meshlet + uint32_t(uint64_t(lod.meshlet_count) * slice / slice_count);
+        const uint32_t last = lod.first_meshlet + uint32_t(uint64_t(lod.meshlet_count) * (slice + 1) / slice_count);
+        for (const meshlet &m: array_view<const meshlet>(meshlets.data() + first, last - first)) {
+            if (!culler.visible(m))
+                continue;
+            for (uint32_t i = m.first_index; i < m.first_index + m.triangle_count * 3; i += 3) {
+                vertex2fragment o1 = transform(indices[i]);
+                vertex2fragment o2 = transform(indices[i + 1]);
+                vertex2fragment o3 = transform(indices[i + 2]);
+                emit(o1, o2, o3);
+            }
         }
     }
 
 private:
+    shared_ptr<const void> storage;
 
+    // The sphere encloses the meshlet spheres, which is tight enough and needs no pass over the vertices.
+    void compute_bounds() {
+        bounds = vertices.get_bounds();
+        sphere.center = bounds.center();
+        sphere.radius = 0.0f;
+        for (const auto &m: meshlets)
+            sphere.radius = std::max(sphere.radius, glm::length(m.center - sphere.center) + m.radius);
+    }
 };
 
 #endif //RAYTRACING_MESH_H
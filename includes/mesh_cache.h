@@ -0,0 +1,403 @@
+#ifndef RAYTRACING_MESH_CACHE_H
+#define RAYTRACING_MESH_CACHE_H
+
+#include "string"
+#include "vector"
+#include "memory"
+#include "cstdio"
+#include "cstdlib"
+#include "cstring"
+#include "algorithm"
+#include "filesystem"
+#include "fstream"
+#include "sstream"
+#include "utils.h"
+#include "mesh.h"
+#include "scene_graph.h"
+#include "mapped_file.h"
+#include "array_view.h"
+
+// Texture references a mesh was imported with, relative to the model directory, empty when absent.
+struct mesh_source {
+    std::string diffuse;
+    std::string specular;
+    std::string normal;
+};
+
+// Directory of imported models, so warm starts skip assimp.
+// Each entry is named after a hash of the source path, mtime and size and holds a header, a mesh table,
+// the node table with its mesh references, the files the import read besides the source (the .mtl
+// libraries of an .obj) with their mtime and size, the texture, node and file names and the vertex
+// streams, index, meshlet and level of detail arrays. Entries are opened with mmap and
+// the meshes point straight into the mapping. An entry is stale once the source or any of those files
+// changed.
+class mesh_cache {
+public:
+    struct file_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t layout_size;
+        uint64_t key;
+        int64_t source_mtime;
+        uint64_t source_size;
+        uint32_t mesh_count;
+        // import options the entry was made with, see model
+        uint32_t import_flags;
+        uint32_t node_count;
+        uint32_t mesh_ref_count;
+        uint32_t dependency_count;
+        uint32_t reserved;
+    };
+
+    struct file_mesh {
+        vertex_streams::layout layout;
+        // one offset per vertex attribute, streams the mesh does not have are empty
+        uint64_t stream_offsets[vertex_attribute_count];
+        uint64_t index_offset;
+        uint64_t index_count;
+        uint64_t meshlet_offset;
+        uint64_t meshlet_count;
+        uint64_t lod_offset;
+        uint64_t lod_count;
+        // diffuse, specular and normal texture names, offset and length into the file
+        uint64_t texture_offsets[3];
+        uint32_t texture_lengths[3];
+        uint32_t reserved;
+    };
+
+    // Nodes are stored in scene_graph order, their meshes are a range of the mesh reference array.
+    struct file_node {
+        int32_t parent;
+        uint32_t first_mesh;
+        uint32_t mesh_count;
+        uint32_t name_length;
+        uint64_t name_offset;
+        float local[16];
+    };
+
+    // A file the import read, relative to the source's directory. A missing file has mtime -1.
+    struct file_dependency {
+        uint64_t name_offset;
+        uint32_t name_length;
+        uint32_t reserved;
+        int64_t mtime;
+        uint64_t size;
+    };
+
+    struct cached_mesh {
+        vertex_streams vertices;
+        array_view<const unsigned int> indices;
+        array_view<const meshlet> meshlets;
+        array_view<const mesh_lod> lods;
+        mesh_source source;
+    };
+
+    struct cached_model {
+        std::shared_ptr<mapped_file> file;
+        std::vector<cached_mesh> meshes;
+        scene_graph scene;
+    };
+
+    static constexpr uint32_t format_version = 8;
+    static constexpr size_t array_alignment = 64;
+
+    static mesh_cache &instance() {
+        static mesh_cache cache;
+        return cache;
+    }
+
+    // An empty directory disables the cache.
+    void set_directory(const std::string &dir) {
+        directory = dir;
+    }
+
+    const std::string &get_directory() const {
+        return directory;
+    }
+
+    std::unique_ptr<cached_model> load(const std::string &source_path, uint32_t import_flags = 0) const {
+        file_header expected{};
+        std::string entry = entry_path(source_path, import_flags, expected);
+        if (entry.empty())
+            return nullptr;
+        std::shared_ptr<mapped_file> file = mapped_file::open(entry);
+        if (!file || file->size() < sizeof(file_header))
+            return nullptr;
+
+        file_header header{};
+        std::memcpy(&header, file->data(), sizeof(header));
+        if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+            header.version != format_version || header.layout_size != sizeof(vertex_streams::layout) ||
+            header.key != expected.key || header.import_flags != expected.import_flags ||
+            header.source_mtime != expected.source_mtime || header.source_size != expected.source_size ||
+            file->size() < tables_size(header))
+            return nullptr;
+
+        const unsigned char *dependency_table = file->data() + tables_size(header) -
+                                                header.dependency_count * sizeof(file_dependency);
+        for (uint32_t d = 0; d < header.dependency_count; ++d) {
+            file_dependency record{};
+            std::memcpy(&record, dependency_table + d * sizeof(file_dependency), sizeof(record));
+            if (record.name_offset + record.name_length > file->size())
+                return nullptr;
+            file_dependency current = stamp(directory_of(source_path) + std::string(
+                    reinterpret_cast<const char *>(file->data() + record.name_offset), record.name_length));
+            if (current.mtime != record.mtime || current.size != record.size)
+                return nullptr;
+        }
+
+        auto model = std::make_unique<cached_model>();
+        model->file = file;
+        for (uint32_t m = 0; m < header.mesh_count; ++m) {
+            file_mesh record{};
+            std::memcpy(&record, file->data() + sizeof(file_header) + m * sizeof(file_mesh), sizeof(record));
+            if (record.index_offset + record.index_count * sizeof(unsigned int) > file->size() ||
+                record.meshlet_offset + record.meshlet_count * sizeof(meshlet) > file->size() ||
+                record.lod_count == 0 || record.lod_offset + record.lod_count * sizeof(mesh_lod) > file->size())
+                return nullptr;
+            cached_mesh cached;
+            cached.vertices.info = record.layout;
+            for (int s = 0; s < vertex_attribute_count; ++s) {
+                if (!(record.layout.attributes & (1u << s)))
+                    continue;
+                size_t bytes = vertex_streams::element_size(s, record.layout) * record.layout.count;
+                if (record.stream_offsets[s] + bytes > file->size())
+                    return nullptr;
+                cached.vertices.streams[s] = array_view<const unsigned char>(file->data() + record.stream_offsets[s],
+                                                                             bytes);
+            }
+            cached.indices = array_view<const unsigned int>(
+                    reinterpret_cast<const unsigned int *>(file->data() + record.index_offset), record.index_count);
+            cached.meshlets = array_view<const meshlet>(
+                    reinterpret_cast<const meshlet *>(file->data() + record.meshlet_offset), record.meshlet_count);
+            cached.lods = array_view<const mesh_lod>(
+                    reinterpret_cast<const mesh_lod *>(file->data() + record.lod_offset), record.lod_count);
+            // a corrupt entry must not send draws outside the mapping
+            for (const auto &lod: cached.lods)
+                if (uint64_t(lod.first_meshlet) + lod.meshlet_count > record.meshlet_count)
+                    return nullptr;
+            for (const auto &m: cached.meshlets)
+                if (uint64_t(m.first_index) + uint64_t(m.triangle_count) * 3 > record.index_count)
+                    return nullptr;
+            for (unsigned int index: cached.indices)
+                if (index >= record.layout.count)
+                    return nullptr;
+            std::string *names[3] = {&cached.source.diffuse, &cached.source.specular, &cached.source.normal};
+            for (int t = 0; t < 3; ++t) {
+                if (record.texture_offsets[t] + record.texture_lengths[t] > file->size())
+                    return nullptr;
+                names[t]->assign(reinterpret_cast<const char *>(file->data() + record.texture_offsets[t]),
+                                 record.texture_lengths[t]);
+            }
+            model->meshes.push_back(std::move(cached));
+        }
+
+        const unsigned char *node_table = file->data() + sizeof(file_header) + header.mesh_count * sizeof(file_mesh);
+        const unsigned char *ref_table = node_table + header.node_count * sizeof(file_node);
+        std::vector<unsigned int> node_meshes;
+        for (uint32_t n = 0; n < header.node_count; ++n) {
+            file_node record{};
+            std::memcpy(&record, node_table + n * sizeof(file_node), sizeof(record));
+            if (record.parent >= int32_t(n) ||
+                uint64_t(record.first_mesh) + record.mesh_count > header.mesh_ref_count ||
+                record.name_offset + record.name_length > file->size())
+                return nullptr;
+            node_meshes.resize(record.mesh_count);
+            if (record.mesh_count)
+                std::memcpy(node_meshes.data(), ref_table + record.first_mesh * sizeof(uint32_t),
+                            record.mesh_count * sizeof(uint32_t));
+            for (unsigned int m: node_meshes)
+                if (m >= header.mesh_count)
+                    return nullptr;
+            glm::mat4 local;
+            std::memcpy(&local, record.local, sizeof(record.local));
+            model->scene.add_node(record.parent,
+                                  std::string(reinterpret_cast<const char *>(file->data() + record.name_offset),
+                                              record.name_length), local, node_meshes);
+        }
+        return model;
+    }
+
+    void store(const std::string &source_path, const std::vector<mesh> &meshes,
+               const std::vector<mesh_source> &sources, const scene_graph &scene, uint32_t import_flags = 0) const {
+        file_header header{};
+        std::string entry = entry_path(source_path, import_flags, header);
+        if (entry.empty() || meshes.empty() || meshes.size() != sources.size())
+            return;
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+
+        header.version = format_version;
+        header.layout_size = sizeof(vertex_streams::layout);
+        header.mesh_count = static_cast<uint32_t>(meshes.size());
+        header.node_count = static_cast<uint32_t>(scene.size());
+
+        std::vector<file_node> nodes(scene.size());
+        std::vector<uint32_t> mesh_refs;
+        for (size_t n = 0; n < scene.size(); ++n) {
+            const scene_graph::node &source = scene.get_node(static_cast<int>(n));
+            nodes[n].parent = source.parent;
+            nodes[n].first_mesh = static_cast<uint32_t>(mesh_refs.size());
+            nodes[n].mesh_count = source.mesh_count;
+            for (uint32_t k = 0; k < source.mesh_count; ++k)
+                mesh_refs.push_back(scene.get_mesh_index(static_cast<int>(n), k));
+            std::memcpy(nodes[n].local, &scene.get_local_transform(static_cast<int>(n)), sizeof(nodes[n].local));
+        }
+        header.mesh_ref_count = static_cast<uint32_t>(mesh_refs.size());
+
+        std::vector<std::string> dependency_names = material_libraries(source_path);
+        std::vector<file_dependency> dependencies;
+        for (const auto &name: dependency_names)
+            dependencies.push_back(stamp(directory_of(source_path) + name));
+        header.dependency_count = static_cast<uint32_t>(dependencies.size());
+
+        std::vector<file_mesh> records(meshes.size());
+        uint64_t offset = tables_size(header);
+        for (size_t m = 0; m < meshes.size(); ++m) {
+            const std::string *names[3] = {&sources[m].diffuse, &sources[m].specular, &sources[m].normal};
+            for (int t = 0; t < 3; ++t) {
+                records[m].texture_offsets[t] = offset;
+                records[m].texture_lengths[t] = static_cast<uint32_t>(names[t]->size());
+                offset += names[t]->size();
+            }
+        }
+        for (size_t n = 0; n < scene.size(); ++n) {
+            nodes[n].name_offset = offset;
+            nodes[n].name_length = static_cast<uint32_t>(scene.get_name(static_cast<int>(n)).size());
+            offset += nodes[n].name_length;
+        }
+        for (size_t d = 0; d < dependencies.size(); ++d) {
+            dependencies[d].name_offset = offset;
+            dependencies[d].name_length = static_cast<uint32_t>(dependency_names[d].size());
+            offset += dependencies[d].name_length;
+        }
+        for (size_t m = 0; m < meshes.size(); ++m) {
+            records[m].layout = meshes[m].vertices.info;
+            for (int s = 0; s < vertex_attribute_count; ++s) {
+                records[m].stream_offsets[s] = offset = align(offset);
+                offset += meshes[m].vertices.streams[s].size();
+            }
+            records[m].index_offset = offset = align(offset);
+            records[m].index_count = meshes[m].indices.size();
+            offset += meshes[m].indices.size() * sizeof(unsigned int);
+            records[m].meshlet_offset = offset = align(offset);
+            records[m].meshlet_count = meshes[m].meshlets.size();
+            offset += meshes[m].meshlets.size() * sizeof(meshlet);
+            records[m].lod_offset = offset = align(offset);
+            records[m].lod_count = meshes[m].lods.size();
+            offset += meshes[m].lods.size() * sizeof(mesh_lod);
+        }
+
+        bool stored = mapped_file::write_atomically(entry, [&](std::ofstream &out) {
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(file_mesh));
+            out.write(reinterpret_cast<const char *>(nodes.data()), nodes.size() * sizeof(file_node));
+            out.write(reinterpret_cast<const char *>(mesh_refs.data()), mesh_refs.size() * sizeof(uint32_t));
+            out.write(reinterpret_cast<const char *>(dependencies.data()),
+                      dependencies.size() * sizeof(file_dependency));
+            for (const auto &source: sources)
+                out << source.diffuse << source.specular << source.normal;
+            for (size_t n = 0; n < scene.size(); ++n)
+                out << scene.get_name(static_cast<int>(n));
+            for (const auto &name: dependency_names)
+                out << name;
+            for (size_t m = 0; m < meshes.size(); ++m) {
+                for (int s = 0; s < vertex_attribute_count; ++s) {
+                    out.seekp(records[m].stream_offsets[s]);
+                    out.write(reinterpret_cast<const char *>(meshes[m].vertices.streams[s].data()),
+                              meshes[m].vertices.streams[s].size());
+                }
+                out.seekp(records[m].index_offset);
+                out.write(reinterpret_cast<const char *>(meshes[m].indices.data()),
+                          meshes[m].indices.size() * sizeof(unsigned int));
+                out.seekp(records[m].meshlet_offset);
+                out.write(reinterpret_cast<const char *>(meshes[m].meshlets.data()),
+                          meshes[m].meshlets.size() * sizeof(meshlet));
+                out.seekp(records[m].lod_offset);
+                out.write(reinterpret_cast<const char *>(meshes[m].lods.data()),
+                          meshes[m].lods.size() * sizeof(mesh_lod));
+            }
+            return bool(out);
+        });
+        if (!stored)
+            std::cerr << "WARNING: Could not write mesh cache entry '" << entry << "'.\n";
+    }
+
+private:
+    std::string directory;
+
+    mesh_cache() {
+        static char const *env_dir = getenv("MINIRENDER_CACHE_DIR");
+        directory = env_dir != nullptr ? std::string(env_dir) : FileSystem::getPath("cache");
+        if (!directory.empty())
+            directory += "/meshes";
+    }
+
+    // header, mesh, node, mesh reference and dependency tables
+    static uint64_t tables_size(const file_header &header) {
+        return sizeof(file_header) + uint64_t(header.mesh_count) * sizeof(file_mesh) +
+               uint64_t(header.node_count) * sizeof(file_node) + uint64_t(header.mesh_ref_count) * sizeof(uint32_t) +
+               uint64_t(header.dependency_count) * sizeof(file_dependency);
+    }
+
+    static std::string directory_of(const std::string &path) {
+        size_t slash = path.find_last_of('/');
+        return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    }
+
+    static file_dependency stamp(const std::string &path) {
+        file_dependency result{};
+        struct stat info{};
+        result.mtime = -1;
+        if (stat(path.c_str(), &info) == 0) {
+            result.mtime = static_cast<int64_t>(info.st_mtime);
+            result.size = static_cast<uint64_t>(info.st_size);
+        }
+        return result;
+    }
+
+    // Material libraries an .obj names in its mtllib lines, assimp reads them next to the .obj.
+    static std::vector<std::string> material_libraries(const std::string &source_path) {
+        std::vector<std::string> names;
+        if (source_path.size() < 4 || source_path.compare(source_path.size() - 4, 4, ".obj") != 0)
+            return names;
+        std::ifstream in(source_path);
+        std::string line;
+        while (std::getline(in, line)) {
+            if (line.compare(0, 7, "mtllib ") != 0 && line.compare(0, 7, "mtllib\t") != 0)
+                continue;
+            std::istringstream libraries(line.substr(7));
+            std::string name;
+            while (libraries >> name)
+                if (std::find(names.begin(), names.end(), name) == names.end())
+                    names.push_back(name);
+        }
+        return names;
+    }
+
+    static uint64_t align(uint64_t offset) {
+        return (offset + array_alignment - 1) / array_alignment * array_alignment;
+    }
+
+    // Fills in the identifying part of the header, returns an empty path if the source is missing.
+    std::string entry_path(const std::string &source_path, uint32_t import_flags, file_header &header) const {
+        struct stat info{};
+        if (directory.empty() || stat(source_path.c_str(), &info) != 0)
+            return "";
+        std::memcpy(header.magic, "MRMESH\0\0", sizeof(header.magic));
+        header.source_mtime = static_cast<int64_t>(info.st_mtime);
+        header.source_size = static_cast<uint64_t>(info.st_size);
+        header.import_flags = import_flags;
+        uint64_t key = fnv1a_64(source_path.data(), source_path.size());
+        key = fnv1a_64(&header.source_mtime, sizeof(header.source_mtime), key);
+        key = fnv1a_64(&header.source_size, sizeof(header.source_size), key);
+        key = fnv1a_64(&header.import_flags, sizeof(header.import_flags), key);
+        header.key = key;
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.mrmesh", static_cast<unsigned long long>(key));
+        return directory + "/" + name;
+    }
+};
+
+#endif //RAYTRACING_MESH_CACHE_H
@@ -0,0 +1,35 @@
+#ifndef RAYTRACING_MESH_LOD_H
+#define RAYTRACING_MESH_LOD_H
+
+#include "cstdint"
+#include "glm/glm.hpp"
+#include "array_view.h"
+#include "frustum.h"
+
+// One level of detail of a mesh, a run of its meshlets. Level 0 is the full mesh, every later level has
+// fewer triangles and a larger error, the distance in object units its surface may be away from the
+// full one.
+struct mesh_lod {
+    uint32_t first_meshlet;
+    uint32_t meshlet_count;
+    uint32_t triangle_count;
+    float error;
+};
+
+constexpr int max_lod_count = 5;
+
+// Coarsest level whose error, projected to the point of sphere closest to the eye, stays within threshold
+// pixels. eye and sphere are in object space, pixels_per_unit is the projected size of a unit at
+// distance 1, which holds for uniformly scaled models.
+inline size_t select_lod(array_view<const mesh_lod> lods, const bounding_sphere &sphere, const glm::vec3 &eye,
+                         float pixels_per_unit, float threshold) {
+    float distance = glm::length(sphere.center - eye) - sphere.radius;
+    if (distance <= 0.0f)
+        return 0;
+    size_t level = 0;
+    while (level + 1 < lods.size() && lods[level + 1].error * pixels_per_unit <= threshold * distance)
+        ++level;
+    return level;
+}
+
+#endif //RAYTRACING_MESH_LOD_H
@@ -0,0 +1,388 @@
+#ifndef RAYTRACING_MESH_OPTIMIZER_H
+#define RAYTRACING_MESH_OPTIMIZER_H
+
+#include "vector"
+#include "cstring"
+#include "cmath"
+#include "numeric"
+#include "algorithm"
+#include "glm/glm.hpp"
+#include "vertex.h"
+#include "vertex_streams.h"
+#include "meshlet.h"
+#include "mesh_lod.h"
+#include "mesh_simplifier.h"
+
+// Load time reordering of a triangle list, run once at import and stored in the mesh cache:
+//   0. identical vertices are welded, importers emit three unshared vertices per face for formats
+//      such as obj, which leaves no reuse for any order to exploit
+//   1. vertex cache order, Forsyth's "Linear-speed vertex cache optimisation"
+//   2. overdraw order, Sander et al. "Fast triangle reordering for vertex locality and reduced
+//      overdraw": the cache ordered list is cut into clusters that are sorted so outward facing ones,
+//      which tend to occlude the rest, are drawn first
+//   3. meshlets are grown from that order, see partition_meshlets, and cache ordered again inside
+//   4. vertex fetch order, vertices are renumbered in order of first use
+// Levels of detail are simplified from the welded mesh, see mesh_simplifier.h, and go through 1 to 3 on
+// their own. Their meshlets follow those of the full mesh and all levels share the vertices.
+namespace mesh_optimizer {
+
+    // Entries of the fifo post transform cache in mesh::draw, which the miss ratios are measured with.
+    constexpr int cache_size = 16;
+
+    struct statistics {
+        size_t triangles = 0;
+        size_t misses_before = 0;
+        size_t misses_after = 0;
+        // per level of detail
+        size_t lod_triangles[max_lod_count] = {};
+
+        // average cache miss ratio, transformed vertices per triangle
+        float acmr_before() const {
+            return triangles ? float(misses_before) / triangles : 0.0f;
+        }
+
+        float acmr_after() const {
+            return triangles ? float(misses_after) / triangles : 0.0f;
+        }
+
+        statistics &operator+=(const statistics &other) {
+            triangles += other.triangles;
+            misses_before += other.misses_before;
+            misses_after += other.misses_after;
+            for (int l = 0; l < max_lod_count; ++l)
+                lod_triangles[l] += other.lod_triangles[l];
+            return *this;
+        }
+    };
+
+    // Fifo post transform cache simulation, holds the last size vertices that missed.
+    class fifo_cache {
+    public:
+        fifo_cache(size_t vertex_count, int _size = cache_size) : inserted(vertex_count, 0), size(_size) {}
+
+        // true on a miss
+        bool access(unsigned int v) {
+            if (inserted[v] > flushed && misses - inserted[v] < size_t(size))
+                return false;
+            inserted[v] = ++misses;
+            return true;
+        }
+
+        void flush() {
+            flushed = misses;
+        }
+
+        size_t get_misses() const {
+            return misses;
+        }
+
+    private:
+        std::vector<size_t> inserted;
+        int size;
+        size_t misses = 0;
+        size_t flushed = 0;
+    };
+
+    // Vertex transforms a fifo cache of the given size needs for indices, optionally per triangle.
+    inline size_t count_cache_misses(const std::vector<unsigned int> &indices, size_t vertex_count,
+                                     int fifo_size = cache_size, std::vector<unsigned char> *triangle_misses = nullptr) {
+        fifo_cache cache(vertex_count, fifo_size);
+        for (size_t i = 0; i < indices.size(); i += 3) {
+            unsigned char triangle = 0;
+            for (size_t k = 0; k < 3; ++k)
+                triangle += cache.access(indices[i + k]);
+            if (triangle_misses)
+                triangle_misses->push_back(triangle);
+        }
+        return cache.get_misses();
+    }
+
+    namespace detail {
+        constexpr int forsyth_cache_size = 32;
+
+        inline float forsyth_score(int cache_position, int remaining) {
+            if (remaining == 0)
+                return -1.0f;
+            float score = 0.0f;
+            if (cache_position >= 0) {
+                if (cache_position < 3)
+                    score = 0.75f;
+                else
+                    score = std::pow(1.0f - float(cache_position - 3) / (forsyth_cache_size - 3), 1.5f);
+            }
+            return score + 2.0f / std::sqrt(float(remaining));
+        }
+    }
+
+    inline std::vector<unsigned int> optimize_vertex_cache(const std::vector<unsigned int> &indices,
+                                                           size_t vertex_count) {
+        using namespace detail;
+        const size_t triangle_count = indices.size() / 3;
+
+        // triangles of every vertex, compressed
+        std::vector<unsigned int> offsets(vertex_count + 1, 0);
+        for (unsigned int v: indices)
+            ++offsets[v + 1];
+        for (size_t v = 0; v < vertex_count; ++v)
+            offsets[v + 1] += offsets[v];
+        std::vector<unsigned int> adjacency(indices.size());
+        std::vector<unsigned int> remaining(vertex_count, 0);
+        for (size_t t = 0; t < triangle_count; ++t)
+            for (int k = 0; k < 3; ++k) {
+                unsigned int v = indices[t * 3 + k];
+                adjacency[offsets[v] + remaining[v]++] = static_cast<unsigned int>(t);
+            }
+
+        std::vector<int> cache_position(vertex_count, -1);
+        std::vector<float> vertex_score(vertex_count);
+        for (size_t v = 0; v < vertex_count; ++v)
+            vertex_score[v] = forsyth_score(-1, remaining[v]);
+        std::vector<float> triangle_score(triangle_count);
+        for (size_t t = 0; t < triangle_count; ++t)
+            triangle_score[t] = vertex_score[indices[t * 3]] + vertex_score[indices[t * 3 + 1]] +
+                                vertex_score[indices[t * 3 + 2]];
+        std::vector<bool> emitted(triangle_count, false);
+
+        std::vector<unsigned int> cache, next_cache;
+        cache.reserve(forsyth_cache_size + 3);
+        next_cache.reserve(forsyth_cache_size + 3);
+        std::vector<unsigned int> result;
+        result.reserve(indices.size());
+        size_t scan = 0;
+        long best = -1;
+
+        for (size_t emitted_count = 0; emitted_count < triangle_count; ++emitted_count) {
+            if (best < 0) {
+                // dead end, nothing in the cache has triangles left: continue in input order
+                while (emitted[scan])
+                    ++scan;
+                best = static_cast<long>(scan);
+            }
+            const unsigned int *triangle = &indices[best * 3];
+            result.insert(result.end(), triangle, triangle + 3);
+            emitted[best] = true;
+
+            // the triangle's vertices move to the front of the lru cache
+            next_cache.assign(triangle, triangle + 3);
+            for (unsigned int v: cache)
+                if (v != triangle[0] && v != triangle[1] && v != triangle[2])
+                    next_cache.push_back(v);
+            for (int k = 0; k < 3; ++k) {
+                unsigned int v = triangle[k];
+                unsigned int *list = &adjacency[offsets[v]];
+                for (unsigned int i = 0; i < remaining[v]; ++i)
+                    if (list[i] == static_cast<unsigned int>(best)) {
+                        std::swap(list[i], list[remaining[v] - 1]);
+                        break;
+                    }
+                --remaining[v];
+            }
+
+            // rescore the vertices that were or are cached and their triangles
+            for (size_t i = 0; i < next_cache.size(); ++i) {
+                unsigned int v = next_cache[i];
+                cache_position[v] = i < size_t(forsyth_cache_size) ? static_cast<int>(i) : -1;
+                float score = forsyth_score(cache_position[v], remaining[v]);
+                float delta = score - vertex_score[v];
+                vertex_score[v] = score;
+                for (unsigned int a = 0; a < remaining[v]; ++a)
+                    triangle_score[adjacency[offsets[v] + a]] += delta;
+            }
+            best = -1;
+            float best_score = -1.0f;
+            for (size_t i = 0; i < next_cache.size() && i < size_t(forsyth_cache_size); ++i) {
+                unsigned int v = next_cache[i];
+                for (unsigned int a = 0; a < remaining[v]; ++a) {
+                    unsigned int t = adjacency[offsets[v] + a];
+                    if (triangle_score[t] > best_score) {
+                        best_score = triangle_score[t];
+                        best = t;
+                    }
+                }
+            }
+            if (next_cache.size() > size_t(forsyth_cache_size))
+                next_cache.resize(forsyth_cache_size);
+            std::swap(cache, next_cache);
+        }
+        return result;
+    }
+
+    // Reorders clusters of a cache optimized list, a cluster is cut where the fifo cache would be
+    // refilled anyway or where its miss ratio is within threshold of the surrounding one.
+    inline std::vector<unsigned int> optimize_overdraw(const std::vector<unsigned int> &indices,
+                                                       const std::vector<vertex> &vertices,
+                                                       float threshold = 1.05f) {
+        const size_t triangle_count = indices.size() / 3;
+        if (triangle_count == 0)
+            return indices;
+        std::vector<unsigned char> triangle_misses;
+        count_cache_misses(indices, vertices.size(), cache_size, &triangle_misses);
+
+        // hard boundaries, triangles whose vertices all miss
+        std::vector<size_t> hard{0};
+        for (size_t t = 1; t < triangle_count; ++t)
+            if (triangle_misses[t] == 3)
+                hard.push_back(t);
+        hard.push_back(triangle_count);
+
+        // soft boundaries inside, simulated with a cache flushed at every cut
+        std::vector<size_t> clusters;
+        fifo_cache cache(vertices.size());
+        for (size_t h = 0; h + 1 < hard.size(); ++h) {
+            size_t begin = hard[h], end = hard[h + 1];
+            size_t misses = 0;
+            for (size_t t = begin; t < end; ++t)
+                misses += triangle_misses[t];
+            float cluster_acmr = float(misses) / (end - begin);
+
+            clusters.push_back(begin);
+            cache.flush();
+            size_t part_begin = begin, part_misses = 0;
+            for (size_t t = begin; t < end; ++t) {
+                for (int k = 0; k < 3; ++k)
+                    part_misses += cache.access(indices[t * 3 + k]);
+                size_t part_triangles = t + 1 - part_begin;
+                if (t + 1 < end && part_triangles >= size_t(cache_size) &&
+                    float(part_misses) / part_triangles <= cluster_acmr * threshold) {
+                    clusters.push_back(t + 1);
+                    cache.flush();
+                    part_begin = t + 1;
+                    part_misses = 0;
+                }
+            }
+        }
+        clusters.push_back(triangle_count);
+
+        // view independent sort key, how far the cluster faces away from the mesh center
+        glm::vec3 mesh_centroid(0.0f);
+        for (const auto &v: vertices)
+            mesh_centroid += glm::vec3(v.position);
+        mesh_centroid /= float(std::max<size_t>(vertices.size(), 1));
+
+        std::vector<float> key(clusters.size() - 1);
+        for (size_t c = 0; c + 1 < clusters.size(); ++c) {
+            glm::vec3 centroid(0.0f), normal(0.0f);
+            float area = 0.0f;
+            for (size_t t = clusters[c]; t < clusters[c + 1]; ++t) {
+                glm::vec3 p0(vertices[indices[t * 3]].position);
+                glm::vec3 p1(vertices[indices[t * 3 + 1]].position);
+                glm::vec3 p2(vertices[indices[t * 3 + 2]].position);
+                glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+                float a = glm::length(n);
+                centroid += (p0 + p1 + p2) * (a / 3.0f);
+                normal += n;
+                area += a;
+            }
+            float normal_length = glm::length(normal);
+            key[c] = area > 0.0f && normal_length > 0.0f ?
+                     glm::dot(centroid / area - mesh_centroid, normal / normal_length) : 0.0f;
+        }
+
+        std::vector<size_t> order(key.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return key[a] > key[b]; });
+        std::vector<unsigned int> result;
+        result.reserve(indices.size());
+        for (size_t c: order)
+            result.insert(result.end(), indices.begin() + clusters[c] * 3, indices.begin() + clusters[c + 1] * 3);
+        return result;
+    }
+
+    // Merges vertices whose given attributes are bitwise equal.
+    inline void weld_vertices(std::vector<vertex> &vertices, std::vector<unsigned int> &indices, uint32_t attributes) {
+        std::vector<unsigned int> remap = find_duplicate_vertices(vertices, attributes);
+        std::vector<vertex> welded;
+        for (size_t v = 0; v < vertices.size(); ++v) {
+            if (remap[v] == v) {
+                remap[v] = static_cast<unsigned int>(welded.size());
+                welded.push_back(vertices[v]);
+            } else {
+                remap[v] = remap[remap[v]];
+            }
+        }
+        for (unsigned int &index: indices)
+            index = remap[index];
+        vertices.swap(welded);
+    }
+
+    // Renumbers vertices in order of first use and drops unreferenced ones.
+    inline void optimize_vertex_fetch(std::vector<vertex> &vertices, std::vector<unsigned int> &indices) {
+        std::vector<unsigned int> remap(vertices.size(), ~0u);
+        std::vector<vertex> reordered;
+        reordered.reserve(vertices.size());
+        for (unsigned int &index: indices) {
+            if (remap[index] == ~0u) {
+                remap[index] = static_cast<unsigned int>(reordered.size());
+                reordered.push_back(vertices[index]);
+            }
+            index = remap[index];
+        }
+        vertices.swap(reordered);
+    }
+
+    // Passes 1 to 3 on one triangle list, returns its meshlets.
+    inline std::vector<meshlet> optimize_triangles(const std::vector<vertex> &vertices,
+                                                   std::vector<unsigned int> &indices) {
+        indices = optimize_vertex_cache(indices, vertices.size());
+        indices = optimize_overdraw(indices, vertices);
+        std::vector<meshlet> meshlets = partition_meshlets(vertices, indices);
+        // growing the meshlets scrambles the cache order inside each of them, redo it locally
+        std::vector<unsigned int> local, global;
+        for (const auto &m: meshlets) {
+            auto begin = indices.begin() + m.first_index, end = begin + m.triangle_count * 3;
+            local.assign(begin, end);
+            global.assign(begin, end);
+            std::sort(global.begin(), global.end());
+            global.erase(std::unique(global.begin(), global.end()), global.end());
+            for (unsigned int &index: local)
+                index = static_cast<unsigned int>(std::lower_bound(global.begin(), global.end(), index) - global.begin());
+            local = optimize_vertex_cache(local, global.size());
+            for (size_t i = 0; i < local.size(); ++i)
+                begin[i] = global[local[i]];
+        }
+        return meshlets;
+    }
+
+    // All passes, indices has to be a triangle list. Only the given attributes are compared when
+    // welding, the others may hold anything. Up to lod_count levels of detail are built, the coarsest
+    // within max_lod_error of the full mesh as a fraction of its size; indices receives all of them.
+    inline statistics optimize(std::vector<vertex> &vertices, std::vector<unsigned int> &indices,
+                               uint32_t attributes, std::vector<meshlet> &meshlets, std::vector<mesh_lod> &lods,
+                               int lod_count = 1, float max_lod_error = 0.05f) {
+        statistics stats;
+        stats.triangles = indices.size() / 3;
+        // measured on the welded list, before that every vertex misses
+        weld_vertices(vertices, indices, attributes);
+        stats.misses_before = count_cache_misses(indices, vertices.size());
+
+        aabb box = aabb::none();
+        for (const auto &v: vertices)
+            box.expand(glm::vec3(v.position));
+        std::vector<float> errors;
+        std::vector<std::vector<unsigned int>> levels = build_lod_chain(
+                vertices, indices, std::min(lod_count, max_lod_count),
+                box.empty() ? 0.0f : max_lod_error * glm::length(box.extent()), errors);
+
+        indices.clear();
+        meshlets.clear();
+        lods.clear();
+        for (size_t l = 0; l < levels.size(); ++l) {
+            std::vector<meshlet> level_meshlets = optimize_triangles(vertices, levels[l]);
+            if (l == 0)
+                stats.misses_after = count_cache_misses(levels[l], vertices.size());
+            stats.lod_triangles[l] = levels[l].size() / 3;
+            lods.push_back({static_cast<uint32_t>(meshlets.size()), static_cast<uint32_t>(level_meshlets.size()),
+                            static_cast<uint32_t>(levels[l].size() / 3), errors[l]});
+            for (auto &m: level_meshlets) {
+                m.first_index += static_cast<uint32_t>(indices.size());
+                meshlets.push_back(m);
+            }
+            indices.insert(indices.end(), levels[l].begin(), levels[l].end());
+        }
+        // renumbering keeps every index and so the miss count
+        optimize_vertex_fetch(vertices, indices);
+        return stats;
+    }
+}
+
+#endif //RAYTRACING_MESH_OPTIMIZER_H
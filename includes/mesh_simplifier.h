@@ -0,0 +1,261 @@
+#ifndef RAYTRACING_MESH_SIMPLIFIER_H
+#define RAYTRACING_MESH_SIMPLIFIER_H
+
+#include "vector"
+#include "cmath"
+#include "numeric"
+#include "algorithm"
+#include "cstdint"
+#include "glm/glm.hpp"
+#include "vertex.h"
+#include "vertex_streams.h"
+#include "task_scheduler.h"
+
+// Edge collapse simplification with quadric error metrics (Garland and Heckbert, "Surface Simplification
+// Using Quadric Error Metrics"). Only the index list changes, a vertex collapses onto a neighbour that
+// already exists, so every level of detail shares the vertices of the full mesh.
+namespace mesh_optimizer {
+
+    namespace detail {
+        // Area weighted sum of squared distances to planes, stored as the symmetric 4x4 matrix's upper half.
+        struct quadric {
+            double a00 = 0, a01 = 0, a02 = 0, a11 = 0, a12 = 0, a22 = 0;
+            double b0 = 0, b1 = 0, b2 = 0, c = 0;
+            double weight = 0;
+
+            void add_plane(const glm::dvec3 &n, double d, double w) {
+                a00 += w * n.x * n.x;
+                a01 += w * n.x * n.y;
+                a02 += w * n.x * n.z;
+                a11 += w * n.y * n.y;
+                a12 += w * n.y * n.z;
+                a22 += w * n.z * n.z;
+                b0 += w * n.x * d;
+                b1 += w * n.y * d;
+                b2 += w * n.z * d;
+                c += w * d * d;
+                weight += w;
+            }
+
+            quadric &operator+=(const quadric &q) {
+                a00 += q.a00, a01 += q.a01, a02 += q.a02, a11 += q.a11, a12 += q.a12, a22 += q.a22;
+                b0 += q.b0, b1 += q.b1, b2 += q.b2, c += q.c;
+                weight += q.weight;
+                return *this;
+            }
+
+            // mean squared distance of p to the planes
+            double error(const glm::vec3 &p) const {
+                double x = p.x, y = p.y, z = p.z;
+                double e = a00 * x * x + a11 * y * y + a22 * z * z + 2 * (a01 * x * y + a02 * x * z + a12 * y * z) +
+                           2 * (b0 * x + b1 * y + b2 * z) + c;
+                return weight > 0 ? std::max(e, 0.0) / weight : 0.0;
+            }
+        };
+
+        struct collapse {
+            unsigned int from;
+            unsigned int to;
+            float cost;
+        };
+    }
+
+    // Collapses edges until indices has at most target_index_count entries or the next collapse would move
+    // the surface further than target_error, both in object units. Vertices on open borders and on
+    // attribute seams stay where they are so the silhouette and the uv layout hold. result_error receives
+    // the largest deviation the kept collapses introduced.
+    // The quadrics only order the collapses, their error is a mean over the planes. The deviation is a
+    // maximum: every position carries a bound that a collapse onto it raises to the collapsed vertex's
+    // bound plus the farthest its triangles' planes are from the new position.
+    inline std::vector<unsigned int> simplify(const std::vector<vertex> &vertices,
+                                              const std::vector<unsigned int> &indices, size_t target_index_count,
+                                              float target_error, float *result_error = nullptr) {
+        std::vector<unsigned int> result = indices;
+        if (result_error)
+            *result_error = 0.0f;
+        const size_t vertex_count = vertices.size();
+
+        // seams are positions shared by several vertices with different attributes
+        std::vector<unsigned int> position_id = find_duplicate_vertices(vertices, attribute_position);
+        std::vector<unsigned int> wedges(vertex_count, 0);
+        for (size_t v = 0; v < vertex_count; ++v)
+            ++wedges[position_id[v]];
+        std::vector<bool> locked(vertex_count, false);
+        for (size_t v = 0; v < vertex_count; ++v)
+            locked[v] = wedges[position_id[v]] > 1;
+        // border edges are used by one triangle only, counted in either direction
+        auto edge_key = [&](unsigned int a, unsigned int b) {
+            uint64_t pa = position_id[a], pb = position_id[b];
+            return pa < pb ? (pa << 32 | pb) : (pb << 32 | pa);
+        };
+        std::vector<uint64_t> edges;
+        edges.reserve(result.size());
+        for (size_t i = 0; i < result.size(); i += 3)
+            for (int k = 0; k < 3; ++k)
+                edges.push_back(edge_key(result[i + k], result[i + (k + 1) % 3]));
+        std::sort(edges.begin(), edges.end());
+        std::vector<uint64_t> borders;
+        for (size_t e = 0; e < edges.size();) {
+            size_t end = e + 1;
+            while (end < edges.size() && edges[end] == edges[e])
+                ++end;
+            if (end - e == 1)
+                borders.push_back(edges[e]);
+            e = end;
+        }
+        for (size_t i = 0; i < result.size(); i += 3)
+            for (int k = 0; k < 3; ++k)
+                if (std::binary_search(borders.begin(), borders.end(),
+                                       edge_key(result[i + k], result[i + (k + 1) % 3])))
+                    locked[result[i + k]] = locked[result[i + (k + 1) % 3]] = true;
+
+        // quadrics are per position so the wedges of a seam agree
+        std::vector<detail::quadric> quadrics(vertex_count);
+        for (size_t i = 0; i < result.size(); i += 3) {
+            glm::dvec3 p0(vertices[result[i]].position), p1(vertices[result[i + 1]].position),
+                    p2(vertices[result[i + 2]].position);
+            glm::dvec3 n = glm::cross(p1 - p0, p2 - p0);
+            double area = glm::length(n);
+            if (area <= 0.0)
+                continue;
+            n /= area;
+            for (int k = 0; k < 3; ++k)
+                quadrics[position_id[result[i + k]]].add_plane(n, -glm::dot(n, p0), area * 0.5);
+        }
+
+        auto position = [&](unsigned int v) { return glm::vec3(vertices[v].position); };
+        std::vector<unsigned int> offsets, adjacency;
+        std::vector<detail::collapse> candidates;
+        std::vector<bool> touched(vertex_count);
+        // by position id
+        std::vector<float> deviation(vertex_count, 0.0f);
+        // the mean is below the maximum, a collapse above max_cost cannot stay within target_error
+        const double max_cost = double(target_error) * target_error;
+        float worst = 0.0f;
+        while (result.size() > target_index_count) {
+            // triangles around every vertex
+            offsets.assign(vertex_count + 1, 0);
+            for (unsigned int v: result)
+                ++offsets[v + 1];
+            for (size_t v = 0; v < vertex_count; ++v)
+                offsets[v + 1] += offsets[v];
+            adjacency.resize(result.size());
+            std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+            for (size_t i = 0; i < result.size(); ++i)
+                adjacency[fill[result[i]]++] = static_cast<unsigned int>(i / 3);
+
+            candidates.clear();
+            for (size_t i = 0; i < result.size(); i += 3)
+                for (int k = 0; k < 3; ++k)
+                    for (int other = 1; other <= 2; ++other) {
+                        unsigned int from = result[i + k], to = result[i + (k + other) % 3];
+                        if (locked[from])
+                            continue;
+                        detail::quadric q = quadrics[position_id[from]];
+                        q += quadrics[position_id[to]];
+                        double cost = q.error(position(to));
+                        if (cost <= max_cost)
+                            candidates.push_back({from, to, float(cost)});
+                    }
+            if (candidates.empty())
+                break;
+            std::sort(candidates.begin(), candidates.end(),
+                      [](const detail::collapse &a, const detail::collapse &b) { return a.cost < b.cost; });
+
+            // cheapest collapses first, each touches a vertex's one ring at most once per pass so the
+            // adjacency stays valid
+            std::fill(touched.begin(), touched.end(), false);
+            std::vector<unsigned int> remap(vertex_count);
+            std::iota(remap.begin(), remap.end(), 0u);
+            size_t removed = 0;
+            const size_t wanted = (result.size() - target_index_count) / 3;
+            for (const auto &c: candidates) {
+                if (removed >= wanted)
+                    break;
+                if (touched[c.from] || touched[c.to])
+                    continue;
+                // a collapse must not turn any remaining triangle around
+                bool flips = false;
+                float distance = 0.0f;
+                for (unsigned int a = offsets[c.from]; a < offsets[c.from + 1] && !flips; ++a) {
+                    const unsigned int *t = &result[adjacency[a] * 3];
+                    if (t[0] == c.to || t[1] == c.to || t[2] == c.to)
+                        continue;
+                    glm::vec3 before[3], after[3];
+                    for (int k = 0; k < 3; ++k) {
+                        before[k] = position(t[k]);
+                        after[k] = t[k] == c.from ? position(c.to) : before[k];
+                    }
+                    glm::vec3 n0 = glm::cross(before[1] - before[0], before[2] - before[0]);
+                    glm::vec3 n1 = glm::cross(after[1] - after[0], after[2] - after[0]);
+                    flips = glm::dot(n0, n1) <= 0.01f * glm::length(n0) * glm::length(n1);
+                    float area = glm::length(n0);
+                    if (area > 0.0f)
+                        distance = std::max(distance, std::abs(glm::dot(n0, position(c.to) - before[0])) / area);
+                }
+                const float bound = deviation[position_id[c.from]] + distance;
+                if (flips || bound > target_error)
+                    continue;
+                for (unsigned int a = offsets[c.from]; a < offsets[c.from + 1]; ++a) {
+                    const unsigned int *t = &result[adjacency[a] * 3];
+                    for (int k = 0; k < 3; ++k)
+                        touched[t[k]] = true;
+                    removed += t[0] == c.to || t[1] == c.to || t[2] == c.to;
+                }
+                remap[c.from] = c.to;
+                quadrics[position_id[c.to]] += quadrics[position_id[c.from]];
+                deviation[position_id[c.to]] = std::max(deviation[position_id[c.to]], bound);
+                worst = std::max(worst, bound);
+            }
+            if (removed == 0)
+                break;
+
+            size_t out = 0;
+            for (size_t i = 0; i < result.size(); i += 3) {
+                unsigned int a = remap[result[i]], b = remap[result[i + 1]], c = remap[result[i + 2]];
+                if (a == b || b == c || c == a)
+                    continue;
+                result[out++] = a;
+                result[out++] = b;
+                result[out++] = c;
+            }
+            result.resize(out);
+        }
+        if (result_error)
+            *result_error = worst;
+        return result;
+    }
+
+    // Up to count levels, the first being indices, each with about half the triangles of the one before.
+    // The chain ends early once the simplifier cannot get rid of a quarter of the triangles within
+    // max_error, then the surface is mostly border and seams or the error would show. errors receives the
+    // deviation of every level from the full mesh.
+    inline std::vector<std::vector<unsigned int>> build_lod_chain(const std::vector<vertex> &vertices,
+                                                                 const std::vector<unsigned int> &indices, int count,
+                                                                 float max_error, std::vector<float> &errors) {
+        std::vector<std::vector<unsigned int>> levels{indices};
+        errors.assign(1, 0.0f);
+        // simplifying the original every time keeps the quadrics, and so the errors, relative to it, and
+        // makes the levels independent of each other, so they are built in parallel
+        const size_t level_count = static_cast<size_t>(std::max(count, 1));
+        std::vector<std::vector<unsigned int>> simplified(level_count);
+        std::vector<float> simplified_errors(level_count, 0.0f);
+        task_group group;
+        for (size_t level = 1; level < level_count; ++level)
+            group.run([&, level] {
+                size_t target = indices.size() >> level;
+                target -= target % 3;
+                simplified[level] = simplify(vertices, indices, target, max_error, &simplified_errors[level]);
+            });
+        group.wait();
+        for (size_t level = 1; level < level_count; ++level) {
+            if (simplified[level].empty() || simplified[level].size() * 4 > levels.back().size() * 3)
+                break;
+            levels.push_back(std::move(simplified[level]));
+            errors.push_back(std::max(simplified_errors[level], errors.back()));
+        }
+        return levels;
+    }
+}
+
+#endif //RAYTRACING_MESH_SIMPLIFIER_H
@@ -0,0 +1,200 @@
+#ifndef RAYTRACING_MESHLET_H
+#define RAYTRACING_MESHLET_H
+
+#include "vector"
+#include "cmath"
+#include "algorithm"
+#include "glm/glm.hpp"
+#include "vertex_streams.h"
+#include "frustum.h"
+
+// A run of a mesh's triangles, small enough that its bounds are tight, culled as a whole before any of
+// its vertices is transformed. Bounds are in object space.
+struct meshlet {
+    // first index in the mesh's index array and number of triangles
+    uint32_t first_index;
+    uint32_t triangle_count;
+    glm::vec3 center;
+    float radius;
+    // every face normal is within the cone around axis, cutoff is the sine of its half angle and 1
+    // when the cone is too wide to ever cull
+    glm::vec3 cone_axis;
+    float cone_cutoff;
+};
+
+// 124 triangles is about what 64 vertices of a regular mesh span.
+constexpr int meshlet_max_vertices = 64;
+constexpr int meshlet_max_triangles = 124;
+
+// Grows meshlets triangle by triangle over shared vertices, preferring triangles that add few vertices
+// and face along the meshlet's average normal so the cones stay narrow. Each meshlet is seeded with the
+// first unassigned triangle in the given order, which keeps that order roughly intact. indices is
+// rewritten in meshlet order, the returned meshlets have no bounds yet, see compute_meshlet_bounds.
+inline std::vector<meshlet> partition_meshlets(const std::vector<vertex> &vertices, std::vector<unsigned int> &indices,
+                                               float cone_weight = 1.0f) {
+    const size_t triangle_count = indices.size() / 3;
+    // triangles are adjacent when they share a position, uv and normal seams split vertices but not
+    // the surface
+    std::vector<unsigned int> position_id = find_duplicate_vertices(vertices, attribute_position);
+    std::vector<unsigned int> offsets(vertices.size() + 1, 0);
+    for (unsigned int v: indices)
+        ++offsets[position_id[v] + 1];
+    for (size_t v = 0; v < vertices.size(); ++v)
+        offsets[v + 1] += offsets[v];
+    std::vector<unsigned int> adjacency(indices.size());
+    std::vector<unsigned int> fill(vertices.size(), 0);
+    for (size_t t = 0; t < triangle_count; ++t)
+        for (int k = 0; k < 3; ++k) {
+            unsigned int p = position_id[indices[t * 3 + k]];
+            adjacency[offsets[p] + fill[p]++] = static_cast<unsigned int>(t);
+        }
+
+    std::vector<glm::vec3> normals(triangle_count, glm::vec3(0.0f));
+    for (size_t t = 0; t < triangle_count; ++t) {
+        glm::vec3 p0(vertices[indices[t * 3]].position);
+        glm::vec3 n = glm::cross(glm::vec3(vertices[indices[t * 3 + 1]].position) - p0,
+                                 glm::vec3(vertices[indices[t * 3 + 2]].position) - p0);
+        float length = glm::length(n);
+        if (length > 0.0f)
+            normals[t] = n / length;
+    }
+
+    std::vector<bool> assigned(triangle_count, false);
+    std::vector<unsigned int> result;
+    result.reserve(indices.size());
+    std::vector<meshlet> meshlets;
+    std::vector<unsigned int> members;
+    size_t seed = 0;
+    while (true) {
+        while (seed < triangle_count && assigned[seed])
+            ++seed;
+        if (seed == triangle_count)
+            break;
+
+        meshlet m{};
+        m.first_index = static_cast<uint32_t>(result.size());
+        members.clear();
+        glm::vec3 axis(0.0f);
+        long next = static_cast<long>(seed);
+        while (next >= 0) {
+            const unsigned int *triangle = &indices[next * 3];
+            for (int k = 0; k < 3; ++k)
+                if (std::find(members.begin(), members.end(), triangle[k]) == members.end())
+                    members.push_back(triangle[k]);
+            result.insert(result.end(), triangle, triangle + 3);
+            assigned[next] = true;
+            axis += normals[next];
+            if (++m.triangle_count == meshlet_max_triangles)
+                break;
+
+            // best unassigned triangle sharing a vertex with the meshlet
+            glm::vec3 direction = glm::length(axis) > 0.0f ? glm::normalize(axis) : glm::vec3(0.0f);
+            float best_score = INFINITY;
+            next = -1;
+            for (unsigned int v: members)
+                for (unsigned int a = offsets[position_id[v]]; a < offsets[position_id[v] + 1]; ++a) {
+                    unsigned int t = adjacency[a];
+                    if (assigned[t])
+                        continue;
+                    int added = 0;
+                    for (int k = 0; k < 3; ++k)
+                        added += std::find(members.begin(), members.end(), indices[t * 3 + k]) == members.end();
+                    if (members.size() + added > size_t(meshlet_max_vertices))
+                        continue;
+                    float score = float(added) + cone_weight * (1.0f - glm::dot(normals[t], direction));
+                    if (score < best_score) {
+                        best_score = score;
+                        next = t;
+                    }
+                }
+        }
+        meshlets.push_back(m);
+    }
+    indices.swap(result);
+    return meshlets;
+}
+
+// Bounding sphere and normal cone of every meshlet, from the decoded positions so they are exact for
+// whatever precision the streams hold.
+inline void compute_meshlet_bounds(const vertex_streams &vertices, const std::vector<unsigned int> &indices,
+                                   std::vector<meshlet> &meshlets) {
+    std::vector<glm::vec3> positions;
+    for (auto &m: meshlets) {
+        positions.clear();
+        for (size_t i = m.first_index; i < m.first_index + size_t(m.triangle_count) * 3; ++i) {
+            vertex v(glm::vec3(0.0f));
+            vertices.fetch(indices[i], attribute_position, v);
+            positions.emplace_back(v.position);
+        }
+        if (positions.empty())
+            continue;
+
+        glm::vec3 p_min = positions[0], p_max = positions[0];
+        for (const auto &p: positions) {
+            p_min = glm::min(p_min, p);
+            p_max = glm::max(p_max, p);
+        }
+        m.center = (p_min + p_max) * 0.5f;
+        m.radius = 0.0f;
+        for (const auto &p: positions)
+            m.radius = std::max(m.radius, glm::length(p - m.center));
+
+        // degenerate triangles face every way and are left out
+        glm::vec3 axis(0.0f);
+        std::vector<glm::vec3> normals;
+        for (size_t t = 0; t < positions.size(); t += 3) {
+            glm::vec3 n = glm::cross(positions[t + 1] - positions[t], positions[t + 2] - positions[t]);
+            float length = glm::length(n);
+            if (length > 0.0f) {
+                normals.push_back(n / length);
+                axis += n / length;
+            }
+        }
+        m.cone_axis = glm::vec3(0.0f, 0.0f, 1.0f);
+        m.cone_cutoff = 1.0f;
+        if (glm::length(axis) > 0.0f) {
+            m.cone_axis = glm::normalize(axis);
+            float min_dot = 1.0f;
+            for (const auto &n: normals)
+                min_dot = std::min(min_dot, glm::dot(n, m.cone_axis));
+            // past about 84 degrees the cone test would hardly ever cull
+            if (min_dot > 0.1f)
+                m.cone_cutoff = std::sqrt(1.0f - min_dot * min_dot);
+        }
+    }
+}
+
+// View frustum and eye moved into a mesh's object space, so meshlet bounds are tested as they are.
+class meshlet_culler {
+public:
+    meshlet_culler(const glm::mat4 &model, const glm::mat4 &view, const glm::mat4 &projection) :
+            planes(projection * view * model) {
+        glm::mat4 object_to_view = view * model;
+        eye = glm::vec3(glm::inverse(object_to_view) * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+        // a mirroring model matrix flips which side of a face is culled
+        cone_culling = glm::determinant(glm::mat3(model)) > 0.0f;
+    }
+
+    const glm::vec3 &get_eye() const {
+        return eye;
+    }
+
+    bool visible(const meshlet &m) const {
+        if (!planes.intersects(bounding_sphere{m.center, m.radius}))
+            return false;
+        if (cone_culling && m.cone_cutoff < 1.0f) {
+            // every face points away from the eye, wherever in the bounding sphere it is
+            glm::vec3 to_center = m.center - eye;
+            if (glm::dot(to_center, m.cone_axis) >= m.cone_cutoff * glm::length(to_center) + m.radius)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    frustum planes;
+    glm::vec3 eye;
+    bool cone_culling;
+};
+
+#endif //RAYTRACING_MESHLET_H
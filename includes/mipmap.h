@@ -0,0 +1,59 @@
+#ifndef RAYTRACING_MIPMAP_H
+#define RAYTRACING_MIPMAP_H
+
+#include "vector"
+#include "memory"
+#include "algorithm"
+#include "mapped_file.h"
+
+// One level of a mip chain, always stored as tightly packed RGBA8.
+struct mip_level {
+    int width = 0;
+    int height = 0;
+    // points either into storage or into a mapped cache file
+    const unsigned char *texels = nullptr;
+    std::vector<unsigned char> storage;
+    std::shared_ptr<mapped_file> mapping;
+
+    mip_level(int w, int h) : width(w), height(h), storage(size_t(w) * h * 4) {
+        texels = storage.data();
+    }
+
+    mip_level(int w, int h, std::shared_ptr<mapped_file> file, size_t offset) :
+            width(w), height(h), texels(file->data() + offset), mapping(std::move(file)) {}
+
+    ~mip_level() {
+        // evicting a mapped level gives its pages back, they stay in the shared page cache
+        if (mapping)
+            mapping->release(texels - mapping->data(), bytes());
+    }
+
+    mip_level(const mip_level &) = delete;
+
+    mip_level &operator=(const mip_level &) = delete;
+
+    size_t bytes() const {
+        return size_t(width) * height * 4;
+    }
+
+    // 2x2 box filter, edges are clamped for odd sizes.
+    std::unique_ptr<mip_level> downsample() const {
+        auto result = std::make_unique<mip_level>(std::max(1, width / 2), std::max(1, height / 2));
+        unsigned char *dst = result->storage.data();
+        for (int j = 0; j < result->height; ++j) {
+            const unsigned char *row0 = texels + std::min(2 * j, height - 1) * width * 4;
+            const unsigned char *row1 = texels + std::min(2 * j + 1, height - 1) * width * 4;
+            for (int i = 0; i < result->width; ++i) {
+                int x0 = std::min(2 * i, width - 1) * 4;
+                int x1 = std::min(2 * i + 1, width - 1) * 4;
+                for (int k = 0; k < 4; ++k)
+                    *dst++ = static_cast<unsigned char>((row0[x0 + k] + row0[x1 + k] + row1[x0 + k] + row1[x1 + k] + 2) >> 2);
+            }
+        }
+        return result;
+    }
+};
+
+using mip_chain = std::vector<std::unique_ptr<mip_level>>;
+
+#endif //RAYTRACING_MIPMAP_H
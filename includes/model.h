@@ -2,7 +2,10 @@
 #define RAYTRACING_MODEL_H
 
 #include "mesh.h"
+#include "mesh_cache.h"
+#include "scene_graph.h"
 #include "rasterizer.h"
+#include "task_scheduler.h"
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -10,38 +13,255 @@
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
+#include <unordered_map>
+#include <deque>
+#include <future>
 
 
+// Flags of the import passes, part of the mesh cache key.
+enum model_import_flags : uint32_t {
+    // vertex cache, overdraw and vertex fetch order, see mesh_optimizer
+    import_optimize_meshes = 1u << 0,
+    // levels of detail, see mesh_simplifier, built by the optimize pass
+    import_generate_lods = 1u << 1,
+    // unorm16 positions in the model's bounding box and uvs in the mesh's uv bounds, see vertex_streams
+    import_quantize_vertices = 1u << 2,
+};
+
 class model {
 public:
 
-    model(string const &path, bool gamma = false) {
+    model(string const &path, bool gamma = false,
+          uint32_t _import_flags = import_optimize_meshes | import_generate_lods | import_quantize_vertices) :
+            import_flags(_import_flags) {
         load_model(path);
     }
 
     void draw(rasterizer &raster);
 
+    // Skips subtrees and meshes outside view_frustum, which is in world space.
+    void draw(rasterizer &raster, const frustum &view_frustum);
+
+    // Draws the model once per transform, each in place of the rasterizer's model matrix, with the same
+    // runs on the task scheduler while this thread clips and bins, batch after batch in the order of transforms.
+    // runs on the task scheduler while this thread rasterizes, batch after batch in the order of transforms.
+    // Batches and the work in flight are bounded in triangles, large meshes are split into runs of meshlets.
+    void draw_instanced(rasterizer &raster, array_view<const glm::mat4> transforms);
+
+    // Node transforms can be changed between draws, see scene_graph.
+    scene_graph &get_scene() {
+        return scene;
+    }
+
 private:
-    vector<shared_ptr<texture>> textures_loaded;
+    unordered_map<string, shared_ptr<texture>> textures_loaded;
+    // in the order of the source scene, nodes refer to them by index
     vector<mesh> meshes;
+    // geometry of imported meshes, cached ones point into their mapped file instead
+    shared_ptr<geometry_arena> arena;
+    scene_graph scene;
     string directory;
+    uint32_t import_flags;
+    // shared by the meshes of an import, so the edges between them stay closed
+    vertex_streams::encoding encoding;
+    mesh_optimizer::statistics optimizer_statistics;
+
+    // Part of one instance's drawing, the meshlets of one mesh reference of a node or a slice of them.
+    // Pieces of an instance are in the order draw visits the meshes.
+    struct instance_piece {
+        int node;
+        unsigned int mesh;
+        uint32_t slice;
+        uint32_t slice_count;
+        // at the full level of detail, before culling
+        size_t triangles;
+    };
+
+    // Shaded triangles of a run of pieces, three vertices each, split into draws of one mesh at one
+    // model matrix that end where the next one starts.
+    struct instance_batch {
+        struct draw_call {
+            unsigned int mesh;
+            glm::mat4 model_matrix;
+            size_t end;
+        };
+        vector<vertex2fragment> vertices;
+        vector<draw_call> draws;
+    };
+
+    // Culls and shades pieces [first, last) with worker, a shader no other thread uses. Piece g is
+    // pieces[g % pieces.size()] of transforms[g / pieces.size()].
+    instance_batch shade_instances(shader &worker, const frustum &view_frustum, float lod_scale, float lod_threshold,
+                                   array_view<const glm::mat4> transforms, const vector<instance_piece> &pieces,
+                                   size_t first, size_t last) const;
 
     void load_model(string path);
 
-    void process_node(aiNode *node, const aiScene *scene);
+    bool load_cached(const string &path);
+
+    void process_node(aiNode *node, int parent);
+
+    // An aiMesh converted and optimized, not yet placed in the arena.
+    struct imported_mesh {
+        vector<vertex> vertices;
+        vector<unsigned int> indices;
+        vector<meshlet> meshlets;
+        vector<mesh_lod> lods;
+        uint32_t attributes = 0;
+        mesh_optimizer::statistics statistics;
+    };
+
+    imported_mesh import_mesh(const aiMesh *ai_mesh) const;
 
-    mesh process_mesh(aiMesh *mesh, const aiScene *scene);
+    mesh process_mesh(imported_mesh imported, const aiMesh *ai_mesh, const aiScene *scene, mesh_source &source);
 
-    shared_ptr<texture> load_material_textures(aiMaterial *mat, aiTextureType type,
-                                               string typeName);
+    shared_ptr<material> make_material(const mesh_source &source);
+
+    string material_texture_name(aiMaterial *mat, aiTextureType type);
+
+    shared_ptr<texture> load_texture(const string &name, const string &typeName);
 };
 
 void model::draw(rasterizer &raster) {
-    for (auto &meshe: meshes)
-        meshe.draw(raster);
+    draw(raster, raster.get_frustum());
+}
+
+void model::draw(rasterizer &raster, const frustum &view_frustum) {
+    scene.update([this](unsigned int m) -> const aabb & { return meshes[m].bounds; });
+
+    // node bounds are in model space, mesh bounds in the space of their node
+    const glm::mat4 model_matrix = raster.get_model_matrix();
+    scene.traverse(view_frustum.transformed(model_matrix), [&](int node) {
+        const glm::mat4 node_matrix = model_matrix * scene.get_world_transform(node);
+        const frustum object_frustum = view_frustum.transformed(node_matrix);
+        raster.set_model_matrix(node_matrix);
+        for (uint32_t k = 0; k < scene.get_node(node).mesh_count; ++k) {
+            mesh &meshe = meshes[scene.get_mesh_index(node, k)];
+            if (object_frustum.intersects(meshe.sphere) && object_frustum.intersects(meshe.bounds))
+                meshe.draw(raster);
+        }
+    });
+    raster.set_model_matrix(model_matrix);
+}
+
+void model::draw_instanced(rasterizer &raster, array_view<const glm::mat4> transforms) {
+    scene.update([this](unsigned int m) -> const aabb & { return meshes[m].bounds; });
+    const glm::mat4 model_matrix = raster.get_model_matrix();
+    const frustum view_frustum = raster.get_frustum();
+    const float lod_scale = raster.get_lod_scale(), lod_threshold = raster.get_lod_threshold();
+
+    // shaded vertices take about a hundred bytes each, a batch holds up to a few megabytes
+    const size_t batch_triangles = 16384, piece_triangles = batch_triangles / 4;
+    auto pieces = make_shared<vector<instance_piece>>();
+    for (int node = 0; node < static_cast<int>(scene.size()); ++node)
+        for (uint32_t k = 0; k < scene.get_node(node).mesh_count; ++k) {
+            unsigned int index = scene.get_mesh_index(node, k);
+            size_t triangles = meshes[index].lods[0].triangle_count;
+            uint32_t slice_count = static_cast<uint32_t>(std::max<size_t>(
+                    1, std::min<size_t>(meshes[index].lods[0].meshlet_count,
+                                        (triangles + piece_triangles - 1) / piece_triangles)));
+            for (uint32_t slice = 0; slice < slice_count; ++slice)
+                pieces->push_back({node, index, slice, slice_count, (triangles + slice_count - 1) / slice_count});
+        }
+    if (pieces->empty())
+        return;
+    task_scheduler &scheduler = task_scheduler::instance();
+    const size_t in_flight_triangles = scheduler.size() * 2 * batch_triangles;
+
+    std::deque<std::pair<task_future<instance_batch>, size_t>> pending;
+    const size_t piece_count = transforms.size() * pieces->size();
+    size_t submitted = 0, triangles_in_flight = 0;
+    while (submitted < piece_count || !pending.empty()) {
+        while (submitted < piece_count) {
+            size_t last = submitted, triangles = 0;
+            while (last < piece_count && (last == submitted ||
+                                          triangles + (*pieces)[last % pieces->size()].triangles <= batch_triangles))
+                triangles += (*pieces)[last++ % pieces->size()].triangles;
+            if (!pending.empty() && triangles_in_flight + triangles > in_flight_triangles)
+                break;
+            shared_ptr<shader> worker = raster.clone_shader();
+            const size_t first = submitted;
+            pending.emplace_back(scheduler.submit([this, worker, view_frustum, lod_scale, lod_threshold, transforms,
+                                                   pieces, first, last] {
+                return shade_instances(*worker, view_frustum, lod_scale, lod_threshold, transforms, *pieces, first,
+                                       last);
+            }), triangles);
+            triangles_in_flight += triangles;
+            submitted = last;
+        }
+        // shades the oldest batch here if no worker has started it yet
+        instance_batch batch = scheduler.wait(pending.front().first);
+        triangles_in_flight -= pending.front().second;
+        pending.pop_front();
+        size_t begin = 0;
+        for (const auto &draw: batch.draws) {
+            // the fragment stage may read either
+            raster.set_model_matrix(draw.model_matrix);
+            raster.set_material(meshes[draw.mesh]._material);
+            for (size_t v = begin; v < draw.end; v += 3)
+                raster.render_transformed_triangle(batch.vertices[v], batch.vertices[v + 1], batch.vertices[v + 2]);
+            begin = draw.end;
+        }
+    }
+    raster.set_model_matrix(model_matrix);
+}
+
+model::instance_batch model::shade_instances(shader &worker, const frustum &view_frustum, float lod_scale,
+                                             float lod_threshold, array_view<const glm::mat4> transforms,
+                                             const vector<instance_piece> &pieces, size_t first, size_t last) const {
+    instance_batch batch;
+    const uint32_t attributes = worker.get_vertex_attributes();
+    // node state is kept while consecutive pieces share instance and node
+    size_t instance = ~size_t(0);
+    int node = -1;
+    bool node_visible = false;
+    glm::mat4 node_matrix(1.0f);
+    frustum model_frustum = view_frustum, object_frustum = view_frustum;
+    meshlet_culler culler(node_matrix, worker.view_matrix, worker.projection_matrix);
+    for (size_t g = first; g < last; ++g) {
+        const instance_piece &piece = pieces[g % pieces.size()];
+        if (g / pieces.size() != instance) {
+            instance = g / pieces.size();
+            node = -1;
+            model_frustum = view_frustum.transformed(transforms[instance]);
+        }
+        if (piece.node != node) {
+            node = piece.node;
+            // an ancestor outside the frustum has the node's bounds inside its own, so testing the node alone
+            // culls what traversing would
+            const aabb &bounds = scene.get_bounds(node);
+            node_visible = !bounds.empty() && model_frustum.intersects(bounds);
+            if (!node_visible)
+                continue;
+            node_matrix = transforms[instance] * scene.get_world_transform(node);
+            object_frustum = view_frustum.transformed(node_matrix);
+            worker.set_model_matrix(node_matrix);
+            culler = meshlet_culler(node_matrix, worker.view_matrix, worker.projection_matrix);
+        }
+        if (!node_visible)
+            continue;
+        const mesh &meshe = meshes[piece.mesh];
+        if (!object_frustum.intersects(meshe.sphere) || !object_frustum.intersects(meshe.bounds))
+            continue;
+        meshe.for_each_triangle(
+                culler, attributes, lod_scale, lod_threshold,
+                [&](const vertex &v) { return worker.vertex_shader(v); },
+                [&](const vertex2fragment &o1, const vertex2fragment &o2, const vertex2fragment &o3) {
+                    batch.vertices.push_back(o1);
+                    batch.vertices.push_back(o2);
+                    batch.vertices.push_back(o3);
+                }, piece.slice, piece.slice_count);
+        if (batch.vertices.size() > (batch.draws.empty() ? 0 : batch.draws.back().end))
+            batch.draws.push_back({piece.mesh, node_matrix, batch.vertices.size()});
+    }
+    return batch;
 }
 
 void model::load_model(string path) {
+    directory = path.substr(0, path.find_last_of('/'));
+    if (load_cached(path))
+        return;
+
     Assimp::Importer import;
     const aiScene *scene = import.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs);
 
@@ -49,116 +269,187 @@ void model::load_model(string path) {
         cout << "ERROR::ASSIMP::" << import.GetErrorString() << endl;
         return;
     }
-    directory = path.substr(0, path.find_last_of('/'));
 
-    process_node(scene->mRootNode, scene);
-}
+    // a block about the size of the optimized geometry, roughly four bytes of vertex data and eight of
+    // indices over all levels of detail per source index
+    size_t estimate = 0;
+    for (unsigned int i = 0; i < scene->mNumMeshes; i++)
+        estimate += size_t(scene->mMeshes[i]->mNumFaces) * 3 * 12;
+    arena = make_shared<geometry_arena>(std::max<size_t>(estimate, 4096));
+
+    // one quantization box for all meshes, the optimize passes keep the source positions
+    encoding.quantize_positions = encoding.quantize_texcoords = (import_flags & import_quantize_vertices) != 0;
+    encoding.position_box = aabb::none();
+    for (unsigned int i = 0; i < scene->mNumMeshes; i++)
+        for (unsigned int v = 0; v < scene->mMeshes[i]->mNumVertices; v++) {
+            const aiVector3D &p = scene->mMeshes[i]->mVertices[v];
+            encoding.position_box.expand(glm::vec3(p.x, p.y, p.z));
+        }
 
-void model::process_node(aiNode *node, const aiScene *scene) {
-    for (unsigned int i = 0; i < node->mNumMeshes; i++) {
-        aiMesh *mesh = scene->mMeshes[node->mMeshes[i]];
-        meshes.push_back(process_mesh(mesh, scene));
+    // meshes are converted and optimized on the task scheduler, then placed in the arena and given their
+    // materials here in scene order, so the result does not depend on which job finishes first. A finished
+    // import holds its mesh several times over in scratch vectors, so only one job per worker and the next
+    // one to place are in flight.
+    task_scheduler &scheduler = task_scheduler::instance();
+    const size_t in_flight = scheduler.size() + 1;
+    std::deque<task_future<imported_mesh>> imports;
+    unsigned int submitted = 0;
+    vector<mesh_source> sources(scene->mNumMeshes);
+    meshes.reserve(scene->mNumMeshes);
+    for (unsigned int i = 0; i < scene->mNumMeshes; i++) {
+        for (; submitted < scene->mNumMeshes && imports.size() < in_flight; ++submitted) {
+            const aiMesh *ai_mesh = scene->mMeshes[submitted];
+            imports.push_back(scheduler.submit([this, ai_mesh] { return import_mesh(ai_mesh); }));
+        }
+        imported_mesh imported = scheduler.wait(imports.front());
+        imports.pop_front();
+        meshes.push_back(process_mesh(std::move(imported), scene->mMeshes[i], scene, sources[i]));
+    }
+    process_node(scene->mRootNode, -1);
+    if (import_flags & import_optimize_meshes)
+        cout << "mesh reorder: ACMR " << optimizer_statistics.acmr_before() << " -> "
+             << optimizer_statistics.acmr_after() << " over " << optimizer_statistics.triangles << " triangles"
+             << endl;
+    if ((import_flags & import_optimize_meshes) && (import_flags & import_generate_lods)) {
+        cout << "mesh lods: triangles";
+        for (size_t triangles: optimizer_statistics.lod_triangles)
+            cout << " " << triangles;
+        cout << endl;
     }
+    mesh_cache::instance().store(path, meshes, sources, this->scene, import_flags);
+}
+
+// Warm start: the meshes view the mapped cache entry, which stays mapped as long as any of them lives.
+bool model::load_cached(const string &path) {
+    unique_ptr<mesh_cache::cached_model> cached = mesh_cache::instance().load(path, import_flags);
+    if (!cached)
+        return false;
+    meshes.reserve(cached->meshes.size());
+    for (const auto &cached_mesh: cached->meshes)
+        meshes.emplace_back(cached_mesh.vertices, cached_mesh.indices, cached_mesh.meshlets, cached_mesh.lods,
+                            cached->file, make_material(cached_mesh.source));
+    scene = std::move(cached->scene);
+    return true;
+}
+
+// Depth first, which is the order scene_graph needs.
+void model::process_node(aiNode *node, int parent) {
+    // aiMatrix4x4 is row major
+    const aiMatrix4x4 &t = node->mTransformation;
+    glm::mat4 local(t.a1, t.b1, t.c1, t.d1,
+                    t.a2, t.b2, t.c2, t.d2,
+                    t.a3, t.b3, t.c3, t.d3,
+                    t.a4, t.b4, t.c4, t.d4);
+    vector<unsigned int> node_meshes(node->mMeshes, node->mMeshes + node->mNumMeshes);
+    int index = scene.add_node(parent, node->mName.C_Str(), local, node_meshes);
     for (unsigned int i = 0; i < node->mNumChildren; i++) {
-        process_node(node->mChildren[i], scene);
+        process_node(node->mChildren[i], index);
     }
 }
 
-mesh model::process_mesh(aiMesh *ai_mesh, const aiScene *scene) {
-    vector<vertex> vertices;
-    vector<unsigned int> indices;
-    vector<shared_ptr<texture>> textures;
-
-    for (unsigned int i = 0; i < ai_mesh->mNumVertices; i++) {
-        vertex vertex;
-        glm::vec3 vector;
-        // positions
-        vector.x = ai_mesh->mVertices[i].x;
-        vector.y = ai_mesh->mVertices[i].y;
-        vector.z = ai_mesh->mVertices[i].z;
-        vertex.position = glm::vec4(vector, 1.0f);
-        // normals
-        if (ai_mesh->HasNormals()) {
-            vector.x = ai_mesh->mNormals[i].x;
-            vector.y = ai_mesh->mNormals[i].y;
-            vector.z = ai_mesh->mNormals[i].z;
-            vertex.normal = vector;
-        }
-        // texture coordinates
-        if (ai_mesh->mTextureCoords[0]) // does the mesh contain texture coordinates?
-        {
-            glm::vec2 vec;
-            vec.x = ai_mesh->mTextureCoords[0][i].x;
-            vec.y = ai_mesh->mTextureCoords[0][i].y;
-            vertex.texcoord = vec;
-
-            // tangent
-            if (ai_mesh->mTangents) {
-                vector.x = ai_mesh->mTangents[i].x;
-                vector.y = ai_mesh->mTangents[i].y;
-                vector.z = ai_mesh->mTangents[i].z;
-                vertex.tangent = vector;
-            }
-
-            // bitangent
-            if (ai_mesh->mBitangents) {
-                vector.x = ai_mesh->mBitangents[i].x;
-                vector.y = ai_mesh->mBitangents[i].y;
-                vector.z = ai_mesh->mBitangents[i].z;
-                vertex.bitangent = vector;
-            }
-        } else {
-            vertex.texcoord = glm::vec2(0.0f, 0.0f);
-        }
+// Reads nothing but ai_mesh and the import flags, so meshes can be imported concurrently.
+model::imported_mesh model::import_mesh(const aiMesh *ai_mesh) const {
+    imported_mesh result;
+    vector<vertex> &vertices = result.vertices;
+    vector<unsigned int> &indices = result.indices;
+    // assimp has no vertex colors here, uvs are zero when missing
+    uint32_t attributes = attribute_position | attribute_texcoord;
+    if (ai_mesh->HasNormals())
+        attributes |= attribute_normal;
+    if (ai_mesh->mTextureCoords[0] && ai_mesh->mTangents)
+        attributes |= attribute_tangent;
+    if (ai_mesh->mTextureCoords[0] && ai_mesh->mBitangents)
+        attributes |= attribute_bitangent;
+    result.attributes = attributes;
 
-        vertices.push_back(vertex);
+    // one attribute at a time out of its assimp array into the interleaved vertices, which the optimizer
+    // welds and reorders as a whole
+    const size_t vertex_count = ai_mesh->mNumVertices;
+    vertices.resize(vertex_count, vertex(glm::vec3(0.0f), glm::vec4(0.0f), glm::vec2(0.0f), glm::vec3(0.0f)));
+    auto copy_vec3 = [&](const aiVector3D *source, glm::vec3 vertex::*field) {
+        for (size_t i = 0; i < vertex_count; ++i)
+            vertices[i].*field = glm::vec3(source[i].x, source[i].y, source[i].z);
+    };
+    for (size_t i = 0; i < vertex_count; ++i)
+        vertices[i].position = glm::vec4(ai_mesh->mVertices[i].x, ai_mesh->mVertices[i].y, ai_mesh->mVertices[i].z,
+                                         1.0f);
+    if (ai_mesh->HasNormals())
+        copy_vec3(ai_mesh->mNormals, &vertex::normal);
+    if (ai_mesh->mTextureCoords[0]) { // does the mesh contain texture coordinates?
+        const aiVector3D *texcoords = ai_mesh->mTextureCoords[0];
+        for (size_t i = 0; i < vertex_count; ++i)
+            vertices[i].texcoord = glm::vec2(texcoords[i].x, texcoords[i].y);
+        if (ai_mesh->mTangents)
+            copy_vec3(ai_mesh->mTangents, &vertex::tangent);
+        if (ai_mesh->mBitangents)
+            copy_vec3(ai_mesh->mBitangents, &vertex::bitangent);
     }
 
+    // triangulated by assimp, so every face but the odd point or line has three indices
+    indices.reserve(size_t(ai_mesh->mNumFaces) * 3);
     for (unsigned int i = 0; i < ai_mesh->mNumFaces; i++) {
-        aiFace face = ai_mesh->mFaces[i];
-        for (unsigned int j = 0; j < face.mNumIndices; j++)
-            indices.push_back(face.mIndices[j]);
+        const aiFace &face = ai_mesh->mFaces[i];
+        indices.insert(indices.end(), face.mIndices, face.mIndices + face.mNumIndices);
     }
+    if (import_flags & import_optimize_meshes)
+        result.statistics = mesh_optimizer::optimize(vertices, indices, attributes, result.meshlets, result.lods,
+                                                     import_flags & import_generate_lods ? max_lod_count : 1);
+    return result;
+}
+
+mesh model::process_mesh(imported_mesh imported, const aiMesh *ai_mesh, const aiScene *scene,
+                         mesh_source &source) {
+    optimizer_statistics += imported.statistics;
+
     // process materials
     aiMaterial *ai_material = scene->mMaterials[ai_mesh->mMaterialIndex];
     // 1. diffuse maps
-    shared_ptr<texture> diffuse_texture = load_material_textures(ai_material, aiTextureType_DIFFUSE,
-                                                                 "texture_diffuse");
+    source.diffuse = material_texture_name(ai_material, aiTextureType_DIFFUSE);
     // 2. specular maps
-    shared_ptr<texture> specular_texture = load_material_textures(ai_material, aiTextureType_SPECULAR,
-                                                                  "texture_specular");
+    source.specular = material_texture_name(ai_material, aiTextureType_SPECULAR);
     // 3. normal maps
-    shared_ptr<texture> normal_texture = load_material_textures(ai_material, aiTextureType_HEIGHT,
-                                                                "texture_normal");
+    source.normal = material_texture_name(ai_material, aiTextureType_HEIGHT);
 //    // 4. height maps
-//    std::vector<shared_ptr<texture>> height_texture = load_material_textures(ai_material, aiTextureType_AMBIENT,
-//                                                                         "texture_height");
+//    source.height = material_texture_name(ai_material, aiTextureType_AMBIENT);
+
+    // return a mesh object created from the extracted mesh data, its arrays go to the arena
+    return mesh(arena, imported.vertices, std::move(imported.indices), make_material(source), imported.attributes,
+                encoding, std::move(imported.meshlets), std::move(imported.lods));
+}
+
+shared_ptr<material> model::make_material(const mesh_source &source) {
+    shared_ptr<texture> diffuse_texture = load_texture(source.diffuse, "texture_diffuse");
+    shared_ptr<texture> specular_texture = load_texture(source.specular, "texture_specular");
+    shared_ptr<texture> normal_texture = load_texture(source.normal, "texture_normal");
 
     shared_ptr<material> mat = make_shared<lambertian>(glm::vec4(1.0f, 0.0f, 0.0f, 0.0f));
     if (diffuse_texture != nullptr)
         mat = make_shared<lambertian>(diffuse_texture, specular_texture, normal_texture);
-    // return a mesh object created from the extracted mesh data
-    return mesh(vertices, indices, mat);
+    return mat;
 }
 
-shared_ptr<texture> model::load_material_textures(aiMaterial *mat, aiTextureType type, string typeName) {
+string model::material_texture_name(aiMaterial *mat, aiTextureType type) {
     if (mat->GetTextureCount(type) <= 0)
-        return nullptr;
-    shared_ptr<texture> texture_ptr;
-
+        return "";
     aiString str;
     mat->GetTexture(type, 0, &str);
-    for (const auto &texture_loaded: textures_loaded) {
-        if (std::strcmp(texture_loaded->path.data(), str.C_Str()) == 0) {
-            return texture_loaded;
-        }
-    }
-    string filename = string(str.C_Str());
-    filename = this->directory + '/' + filename;
-    auto tex = make_shared<image_texture>(filename.c_str());
+    return str.C_Str();
+}
+
+shared_ptr<texture> model::load_texture(const string &name, const string &typeName) {
+    if (name.empty())
+        return nullptr;
+    string filename = this->directory + '/' + name;
+    auto found = textures_loaded.find(filename);
+    if (found != textures_loaded.end())
+        return found->second;
+
+    // decoding runs on the task scheduler while the remaining meshes are processed, if it fits the budget
+    auto tex = make_shared<image_texture>(filename);
+    tex->prefetch();
     tex->type = typeName;
-    tex->path = str.C_Str();
-    textures_loaded.push_back(tex);
+    tex->path = name;
+    textures_loaded.emplace(filename, tex);
     return tex;
 }
 
@@ -2,7 +2,14 @@
 #define RAYTRACING_RASTERIZER_H
 
 #include "framebuffer.h"
+#include "image_writer.h"
+#include "frame_ring.h"
+#include "accumulator.h"
+#include "functional"
 #include "shader.h"
+#include "meshlet.h"
+#include "task_scheduler.h"
+#include "texture_cache.h"
 
 class rasterizer {
 
@@ -10,21 +17,46 @@ private:
     int width;
     int height;
     int channel;
+    framebuffer_layout layout;
+    depth_format depth;
+    int samples;
     framebuffer *frame_buffer;
     shared_ptr<shader> render;
     glm::mat4 viewport_matrix;
-
+    // largest error in pixels a level of detail may show, see mesh_lod
+    float lod_threshold = 1.0f;
+
+    // A clipped triangle in viewport space, waiting in the bins of the rows of color tiles it covers.
+    struct binned_triangle {
+        vertex2fragment o1, o2, o3;
+        int min_x, min_y, max_x, max_y;
+        float texel_footprint;
+        // index into bin_materials
+        uint32_t material;
+    };
+    // flushed once this many are waiting, about 4 MB
+    static constexpr size_t max_binned = 4096;
+    std::vector<binned_triangle> binned;
+    // indices into binned, one bin per row of color tiles
+    std::vector<std::vector<uint32_t>> bins;
+    std::vector<shared_ptr<material>> bin_materials;
 
 public:
-    rasterizer(const int &w, const int &h, const int &c) :
-            width(w), height(h), channel(c), frame_buffer(nullptr), render(nullptr) {
+    rasterizer(const int &w, const int &h, const int &c, framebuffer_layout _layout = framebuffer_layout::tiled,
+               depth_format _depth = depth_format::d32f, int _samples = 1) :
+            width(w), height(h), channel(c), layout(_layout), depth(_depth), samples(_samples), frame_buffer(nullptr),
+            render(nullptr) {
         init();
     }
 
-    rasterizer(const int &w, const int &h, const int &c, shared_ptr<shader> _shader) :
-            width(w), height(h), channel(c), frame_buffer(nullptr), render(_shader) {
+    rasterizer(const int &w, const int &h, const int &c, shared_ptr<shader> _shader,
+               framebuffer_layout _layout = framebuffer_layout::tiled, depth_format _depth = depth_format::d32f,
+               int _samples = 1) :
+            width(w), height(h), channel(c), layout(_layout), depth(_depth), samples(_samples), frame_buffer(nullptr),
+            render(_shader) {
         viewport_matrix = get_viewport_matrix();
-        frame_buffer = new framebuffer(width, height, channel);
+        frame_buffer = new framebuffer(width, height, channel, layout, depth, samples);
+        reset_bins();
     }
 
     ~rasterizer() {
@@ -39,27 +71,68 @@ public:
         render->set_material(_material);
     }
 
+    // Copy of the current shader with its matrices and lights, for shading on other threads.
+    shared_ptr<shader> clone_shader() const {
+        return render->clone();
+    }
+
+    uint32_t get_vertex_attributes() const {
+        return render->get_vertex_attributes();
+    }
+
+    const glm::mat4 &get_model_matrix() const {
+        return render->model_matrix;
+    }
+
+    // World space frustum of the current view and projection, band and jitter included.
+    frustum get_frustum() const {
+        return frustum(render->projection_matrix * render->view_matrix);
+    }
+
+    meshlet_culler get_meshlet_culler() const {
+        return meshlet_culler(render->model_matrix, render->view_matrix, render->projection_matrix);
+    }
+
+    // Zero always draws the full meshes.
+    void set_lod_threshold(float pixels) {
+        lod_threshold = pixels;
+    }
+
+    float get_lod_threshold() const {
+        return lod_threshold;
+    }
+
+    // Pixels a unit spans at distance one in front of the camera, for a perspective projection.
+    float get_lod_scale() const {
+        return render->projection_matrix[1][1] * height * 0.5f;
+    }
+
     void set_model_matrix(const glm::mat4 &model) {
         render->set_model_matrix(model);
     }
 
     void set_view_matrix(const glm::mat4 &view) {
+        flush();
         render->set_view_matrix(view);
     }
 
     void set_camera_pos(const glm::vec3 &pos) {
+        flush();
         render->set_camera_pos(pos);
     }
 
     void push_dir_light(shared_ptr<direction_light> dir_lig) {
+        flush();
         render->push_dir_light(dir_lig);
     }
 
     void push_spot_light(shared_ptr<spot_light> spot_lig) {
+        flush();
         render->push_spot_light(spot_lig);
     }
 
     void push_point_light(shared_ptr<point_light> point_lig) {
+        flush();
         render->push_point_light(point_lig);
     }
 
@@ -71,8 +144,9 @@ public:
         if (frame_buffer)
             delete frame_buffer;
         viewport_matrix = get_viewport_matrix();
-        frame_buffer = new framebuffer(width, height, channel);
+        frame_buffer = new framebuffer(width, height, channel, layout, depth, samples);
         render = make_shared<shader>();
+        reset_bins();
     }
 
     void resize(const int &w, const int &h) {
@@ -82,15 +156,89 @@ public:
     }
 
     void clear_color_buffer(const glm::vec4 &color) {
+        flush();
         frame_buffer->clear_color_buffer(color);
     }
 
-    void ouput_image() {
-        stbi_flip_vertically_on_write(true);
-//        stbi_write_png(FileSystem::getPath("images/render_triangle.png").c_str(), width, height, channel,
-//                       frame_buffer->buffer_data, 0);
-        stbi_write_png(FileSystem::getPath("test.png").c_str(), width, height, channel,
-                       frame_buffer->buffer_data, 0);
+    void clear_depth_buffer(float depth = 1.0f) {
+        flush();
+        frame_buffer->clear_depth_buffer(depth);
+    }
+
+    void set_resolve_settings(const resolve_settings &settings) {
+        frame_buffer->settings = settings;
+    }
+
+    // Resolved copy of the frame, rows top down.
+    image capture_image() {
+        flush();
+        image frame(width, height, channel);
+        frame_buffer->resolve(frame.pixels.data(), true);
+        return frame;
+    }
+
+    // Writes the frame to path, the format follows the extension (.png, .qoi, .ppm, .raw). In the
+    // background only the resolve happens here, image_encoder::instance().wait() flushes.
+    void output_image(const std::string &path, bool background = true) {
+        if (background)
+            image_encoder::instance().submit(path, capture_image());
+        else
+            image_writer::write(path, capture_image());
+    }
+
+    void accumulate(accumulator &frames) {
+        flush();
+        frames.add(*frame_buffer);
+    }
+
+    // Replaces the frame with the average accumulated so far.
+    void show_accumulated(const accumulator &frames) {
+        flush();
+        frames.store(*frame_buffer);
+    }
+
+    // Resolves the frame straight into the next slot of a shared memory ring and publishes it.
+    bool output_frame(frame_ring &ring) {
+        const frame_ring::header &header = ring.get_header();
+        if (header.width != static_cast<uint32_t>(width) || header.height != static_cast<uint32_t>(height) ||
+            header.channel != static_cast<uint32_t>(channel)) {
+            std::cerr << "ERROR: Frame ring size does not match the frame buffer.\n";
+            return false;
+        }
+        flush();
+        frame_buffer->resolve(ring.begin_frame(), true);
+        ring.publish();
+        return true;
+    }
+
+    // Renders a width x image_height image in bands as high as this rasterizer and streams the rows to
+    // out, top row first, so memory stays bounded by the band size. draw submits the whole scene and is
+    // called once per band with the projection narrowed to the band, clipping does the scissoring.
+    bool render_banded(int image_height, const glm::mat4 &projection, const std::function<void()> &draw,
+                       row_writer &out) {
+        const glm::vec4 background = frame_buffer->get_clear_color();
+        const size_t row_bytes = size_t(width) * channel;
+        bool ok = true;
+        // framebuffer rows count up from the bottom of the image, bands go top down
+        for (int top = image_height; top > 0 && ok; top -= height) {
+            int bottom = top - height;
+            float scale = float(image_height) / height;
+            glm::mat4 band(1.0f);
+            band[1][1] = scale;
+            band[3][1] = scale - 1.0f - 2.0f * bottom / height;
+            render->set_projection_matrix(band * projection);
+
+            clear_color_buffer(background);
+            clear_depth_buffer();
+            draw();
+            flush();
+            frame_buffer->resolve();
+            // the last band may reach below the image
+            for (int y = height - 1; y >= std::max(0, -bottom) && ok; --y)
+                ok = out.write_row(frame_buffer->buffer_data + y * row_bytes);
+        }
+        render->set_projection_matrix(projection);
+        return out.finish() && ok;
     }
 
     glm::mat4 get_viewport_matrix() {
@@ -184,6 +332,17 @@ public:
         return true;
     }
 
+    // true when the whole triangle is outside one of the x, y or z clip planes
+    bool outside_one_plane(const glm::vec4 &v1, const glm::vec4 &v2, const glm::vec4 &v3) {
+        for (int axis = 0; axis < 3; ++axis) {
+            if (v1[axis] > v1.w && v2[axis] > v2.w && v3[axis] > v3.w)
+                return true;
+            if (v1[axis] < -v1.w && v2[axis] < -v2.w && v3[axis] < -v3.w)
+                return true;
+        }
+        return false;
+    }
+
     std::vector<vertex2fragment> sutherland_hodgeman(const vertex2fragment &v1,
                                                      const vertex2fragment &v2,
                                                      const vertex2fragment &v3) {
@@ -229,6 +388,7 @@ public:
     }
 
     void render_point(const vertex &vert) {
+        flush();
         vertex2fragment v2f = render->vertex_shader(vert);
         render->homogeneous_division(v2f.projection_pos);
         v2f.viewport_pos = viewport_matrix * v2f.projection_pos;
@@ -237,6 +397,7 @@ public:
     }
 
     void render_line(const vertex &start_vert, const vertex &end_vert) {
+        flush();
         vertex2fragment v2f_start = render->vertex_shader(start_vert);
         vertex2fragment v2f_end = render->vertex_shader(end_vert);
 
@@ -282,6 +443,7 @@ public:
     }
 
     void render_viewport_line(const glm::vec4 &start_viewport_pos, const glm::vec4 &end_viewport_pos) {
+        flush();
         glm::ivec2 start_index = get_viewport_index(start_viewport_pos);
         glm::ivec2 end_index = get_viewport_index(end_viewport_pos);
         int x0 = start_index.x;
@@ -344,6 +506,80 @@ public:
         }
     }
 
+    // Interpolates the attributes at the given barycentric coordinates and runs the fragment shader.
+    glm::vec4 shade(shader &worker, const vertex2fragment &o1, const vertex2fragment &o2, const vertex2fragment &o3,
+                    float alpha, float beta, float gamma, float Z, float texel_footprint) {
+        auto interpolated_color = interpolate(alpha, beta, gamma, o1.projection_pos.w, o2.projection_pos.w,
+                                              o3.projection_pos.w, o1.color, o2.color, o3.color, Z);
+        auto interpolated_normal = interpolate(alpha, beta, gamma, o1.projection_pos.w, o2.projection_pos.w,
+                                               o3.projection_pos.w, o1.normal, o2.normal, o3.normal, Z);
+        auto interpolated_texcoord = interpolate(alpha, beta, gamma, o1.projection_pos.w, o2.projection_pos.w,
+                                                 o3.projection_pos.w, o1.texcoord, o2.texcoord, o3.texcoord, Z);
+        auto interpolated_projection_pos = interpolate(alpha, beta, gamma, o1.projection_pos.w,
+                                                       o2.projection_pos.w,
+                                                       o3.projection_pos.w, o1.projection_pos,
+                                                       o2.projection_pos,
+                                                       o3.projection_pos, Z);
+        auto interpolated_world_pos = interpolate(alpha, beta, gamma, o1.projection_pos.w, o2.projection_pos.w,
+                                                  o3.projection_pos.w, o1.world_pos, o2.world_pos, o3.world_pos, Z);
+
+        vertex2fragment v2f(interpolated_world_pos, interpolated_projection_pos, interpolated_color,
+                            interpolated_texcoord, interpolated_normal);
+        v2f.texel_footprint = texel_footprint;
+        return worker.fragment_shader(v2f);
+    }
+
+    // 4x msaa: coverage and depth are evaluated per sample, the fragment shader runs once per pixel and
+    // its color goes to the samples that passed the depth test.
+    void rasterize_multisampled(shader &worker, const vertex2fragment &o1, const vertex2fragment &o2,
+                                const vertex2fragment &o3, int min_x, int min_y, int max_x, int max_y,
+                                float texel_footprint) {
+        auto perspective_z = [&](float alpha, float beta, float gamma) {
+            return 1.0f / (alpha / o1.projection_pos.w + beta / o2.projection_pos.w + gamma / o3.projection_pos.w);
+        };
+        for (int j = min_y; j <= max_y; ++j) {
+            for (int i = min_x; i <= max_x; ++i) {
+                float depths[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+                int coverage = 0;
+                for (int s = 0; s < 4; ++s) {
+                    glm::vec2 position = framebuffer::sample_position(s);
+                    auto [alpha, beta, gamma] = compute_barycentric2D(i + position.x, j + position.y,
+                                                                      o1.viewport_pos, o2.viewport_pos,
+                                                                      o3.viewport_pos);
+                    if (!(alpha >= 0 && beta >= 0 && gamma >= 0))
+                        continue;
+                    depths[s] = interpolate(alpha, beta, gamma, o1.projection_pos.w, o2.projection_pos.w,
+                                            o3.projection_pos.w, o1.viewport_pos.z, o2.viewport_pos.z,
+                                            o3.viewport_pos.z, perspective_z(alpha, beta, gamma));
+                    coverage |= 1 << s;
+                }
+                if (!coverage)
+                    continue;
+                int passed = frame_buffer->depth_test_samples(i, j, depths, coverage);
+                if (!passed)
+                    continue;
+
+                // shade at the pixel center, or at a covered sample when the center is outside the
+                // triangle so attributes are never extrapolated
+                glm::vec2 position(0.5f);
+                auto [alpha, beta, gamma] = compute_barycentric2D(i + position.x, j + position.y, o1.viewport_pos,
+                                                                  o2.viewport_pos, o3.viewport_pos);
+                if (!(alpha >= 0 && beta >= 0 && gamma >= 0)) {
+                    int s = 0;
+                    while (!(coverage & (1 << s)))
+                        ++s;
+                    position = framebuffer::sample_position(s);
+                    std::tie(alpha, beta, gamma) = compute_barycentric2D(i + position.x, j + position.y,
+                                                                         o1.viewport_pos, o2.viewport_pos,
+                                                                         o3.viewport_pos);
+                }
+                auto color = shade(worker, o1, o2, o3, alpha, beta, gamma, perspective_z(alpha, beta, gamma),
+                                   texel_footprint);
+                frame_buffer->set_samples(i, j, color, passed);
+            }
+        }
+    }
+
     void render_fragment_triangle(vertex2fragment &o1, vertex2fragment &o2, vertex2fragment &o3) {
         render->homogeneous_division(o1.projection_pos);
         render->homogeneous_division(o2.projection_pos);
@@ -362,56 +598,142 @@ public:
         float maxx = std::max(o1.viewport_pos.x, std::max(o2.viewport_pos.x, o3.viewport_pos.x));
         float maxy = std::max(o1.viewport_pos.y, std::max(o2.viewport_pos.y, o3.viewport_pos.y));
 
-        int min_x = floor(minx);
-        int min_y = floor(miny);
-        int max_x = ceil(maxx);
-        int max_y = ceil(maxy);
-
-        for (int i = min_x; i <= max_x; ++i) {
-            for (int j = min_y; j <= max_y; ++j) {
-//                if (!inside_triangle(i + 0.5, j + 0.5, o1.viewport_pos, o2.viewport_pos, o3.viewport_pos))
-//                    continue;
-                auto [alpha, beta, gamma] = compute_barycentric2D(i + 0.5, j + 0.5, o1.viewport_pos, o2.viewport_pos,
-                                                                  o3.viewport_pos);
-                if (!(alpha >= 0 && beta >= 0 && gamma >= 0))
-                    continue;
+        float screen_area = std::abs((o2.viewport_pos.x - o1.viewport_pos.x) * (o3.viewport_pos.y - o1.viewport_pos.y) -
+                                     (o3.viewport_pos.x - o1.viewport_pos.x) * (o2.viewport_pos.y - o1.viewport_pos.y));
+        float uv_area = std::abs((o2.texcoord.x - o1.texcoord.x) * (o3.texcoord.y - o1.texcoord.y) -
+                                 (o3.texcoord.x - o1.texcoord.x) * (o2.texcoord.y - o1.texcoord.y));
+        float texel_footprint = screen_area > 0.0f ? uv_area / screen_area : 0.0f;
+
+        int min_x = std::max(0, int(floor(minx)));
+        int min_y = std::max(0, int(floor(miny)));
+        int max_x = std::min(width - 1, int(ceil(maxx)));
+        int max_y = std::min(height - 1, int(ceil(maxy)));
+        if (min_x > max_x || min_y > max_y)
+            return;
 
-                float Z = 1.0f / (alpha / o1.projection_pos.w + beta / o2.projection_pos.w +
-                                  gamma / o3.projection_pos.w);
-                auto zp = interpolate(alpha, beta, gamma, o1.projection_pos.w, o2.projection_pos.w,
-                                      o3.projection_pos.w, o1.viewport_pos.z, o2.viewport_pos.z, o3.viewport_pos.z, Z);
-
-                float buf_depth = frame_buffer->get_depth(i, j);
-                if (zp >= buf_depth) continue;
-                frame_buffer->write_depth(i, j, zp);
-
-                auto interpolated_color = interpolate(alpha, beta, gamma, o1.projection_pos.w, o2.projection_pos.w,
-                                                      o3.projection_pos.w, o1.color, o2.color, o3.color, Z);
-                auto interpolated_normal = interpolate(alpha, beta, gamma, o1.projection_pos.w, o2.projection_pos.w,
-                                                       o3.projection_pos.w, o1.normal, o2.normal, o3.normal, Z);
-                auto interpolated_texcoord = interpolate(alpha, beta, gamma, o1.projection_pos.w, o2.projection_pos.w,
-                                                         o3.projection_pos.w, o1.texcoord, o2.texcoord, o3.texcoord, Z);
-                auto interpolated_projection_pos = interpolate(alpha, beta, gamma, o1.projection_pos.w,
-                                                               o2.projection_pos.w,
-                                                               o3.projection_pos.w, o1.projection_pos,
-                                                               o2.projection_pos,
-                                                               o3.projection_pos, Z);
-                auto interpolated_world_pos = interpolate(alpha, beta, gamma, o1.projection_pos.w, o2.projection_pos.w,
-                                                          o3.projection_pos.w, o1.world_pos, o2.world_pos,
-                                                          o3.world_pos, Z);
-
-                vertex2fragment v2f(interpolated_world_pos, interpolated_projection_pos, interpolated_color,
-                                    interpolated_texcoord, interpolated_normal);
-                auto color = render->fragment_shader(v2f);
-                frame_buffer->set_pixel(i, j, color);
+        if (bin_materials.empty() || bin_materials.back() != render->_material)
+            bin_materials.push_back(render->_material);
+        auto index = static_cast<uint32_t>(binned.size());
+        binned.push_back({o1, o2, o3, min_x, min_y, max_x, max_y, texel_footprint,
+                          static_cast<uint32_t>(bin_materials.size() - 1)});
+        for (int row = min_y >> framebuffer::color_tile_shift; row <= max_y >> framebuffer::color_tile_shift; ++row)
+            bins[row].push_back(index);
+        if (binned.size() >= max_binned)
+            flush();
+    }
+
+    // Rasterizes the binned triangles. Every row of color tiles is a task that draws its triangles in the
+    // order they came, so the frame is the same as drawing them one at a time. Called before the frame is
+    // read or cleared and before the camera or lights change, fragment shaders see those and the material
+    // of their triangle but not later matrices.
+    void flush() {
+        if (binned.empty())
+            return;
+        // the linear layout stores the depths of 4 pixels at once, past the end of the row when the
+        // width is not a multiple of 4, the rows of a frame like that are drawn here one after another
+        bool parallel = layout == framebuffer_layout::tiled || width % 4 == 0;
+        texture_cache::concurrent_fetches fetches(texture_cache::instance());
+        task_group rows;
+        for (size_t row = 0; row < bins.size(); ++row) {
+            if (bins[row].empty())
+                continue;
+            if (parallel)
+                rows.run([this, row] { rasterize_bin(row); });
+            else
+                rasterize_bin(row);
+        }
+        rows.wait();
+        binned.clear();
+        for (auto &bin: bins)
+            bin.clear();
+        bin_materials.clear();
+    }
+
+    void reset_bins() {
+        binned.clear();
+        bin_materials.clear();
+        bins.assign((height + framebuffer::color_tile_size - 1) >> framebuffer::color_tile_shift, {});
+    }
+
+    void rasterize_bin(size_t row) {
+        shared_ptr<shader> worker = render->clone();
+        int row_min_y = static_cast<int>(row) << framebuffer::color_tile_shift;
+        int row_max_y = std::min(height - 1, row_min_y + framebuffer::color_tile_size - 1);
+        uint32_t material = UINT32_MAX;
+        for (uint32_t index: bins[row]) {
+            const binned_triangle &triangle = binned[index];
+            if (triangle.material != material) {
+                material = triangle.material;
+                worker->set_material(bin_materials[material]);
             }
+            rasterize(*worker, triangle, std::max(triangle.min_y, row_min_y), std::min(triangle.max_y, row_max_y));
         }
     }
 
+    // Rows min_y to max_y of a binned triangle.
+    void rasterize(shader &worker, const binned_triangle &triangle, int min_y, int max_y) {
+        const vertex2fragment &o1 = triangle.o1, &o2 = triangle.o2, &o3 = triangle.o3;
+        int min_x = triangle.min_x, max_x = triangle.max_x;
+        float texel_footprint = triangle.texel_footprint;
+        if (frame_buffer->samples > 1) {
+            rasterize_multisampled(worker, o1, o2, o3, min_x, min_y, max_x, max_y, texel_footprint);
+            return;
+        }
+
+        // walk rows in aligned groups of 4 pixels so depth is tested and stored 4 at a time
+        for (int j = min_y; j <= max_y; ++j) {
+            for (int x = min_x & ~3; x <= max_x; x += 4) {
+                float alphas[4], betas[4], gammas[4], Zs[4];
+                float depths[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+                int mask = 0;
+                for (int k = 0; k < 4; ++k) {
+                    int i = x + k;
+                    if (i < min_x || i > max_x)
+                        continue;
+                    auto [alpha, beta, gamma] = compute_barycentric2D(i + 0.5, j + 0.5, o1.viewport_pos,
+                                                                      o2.viewport_pos, o3.viewport_pos);
+                    if (!(alpha >= 0 && beta >= 0 && gamma >= 0))
+                        continue;
+                    float Z = 1.0f / (alpha / o1.projection_pos.w + beta / o2.projection_pos.w +
+                                      gamma / o3.projection_pos.w);
+                    depths[k] = interpolate(alpha, beta, gamma, o1.projection_pos.w, o2.projection_pos.w,
+                                            o3.projection_pos.w, o1.viewport_pos.z, o2.viewport_pos.z,
+                                            o3.viewport_pos.z, Z);
+                    alphas[k] = alpha;
+                    betas[k] = beta;
+                    gammas[k] = gamma;
+                    Zs[k] = Z;
+                    mask |= 1 << k;
+                }
+                if (!mask)
+                    continue;
+                mask = frame_buffer->depth_test4(x, j, depths, mask);
+
+                for (int k = 0; k < 4; ++k) {
+                    if (!(mask & (1 << k)))
+                        continue;
+                    auto color = shade(worker, o1, o2, o3, alphas[k], betas[k], gammas[k], Zs[k],
+                                       texel_footprint);
+                    frame_buffer->set_pixel(x + k, j, color);
+                }
+            }
+        }
+    }
+
+    vertex2fragment transform_vertex(const vertex &v) {
+        return render->vertex_shader(v);
+    }
+
     void render_triangle(const vertex &v1, const vertex &v2, const vertex &v3) {
-        vertex2fragment o1 = render->vertex_shader(v1);
-        vertex2fragment o2 = render->vertex_shader(v2);
-        vertex2fragment o3 = render->vertex_shader(v3);
+        render_transformed_triangle(render->vertex_shader(v1), render->vertex_shader(v2), render->vertex_shader(v3));
+    }
+
+    // Takes vertex shader outputs, so meshes can reuse the transforms of shared vertices. The clipped
+    // triangles are set up and binned here, flush() rasterizes them.
+    void render_transformed_triangle(vertex2fragment o1, vertex2fragment o2, vertex2fragment o3) {
+        // cheap reject before clipping, most triangles are outside the band when rendering banded
+        if (outside_one_plane(o1.projection_pos, o2.projection_pos, o3.projection_pos))
+            return;
 
         //Clip Triangle
         std::vector<vertex2fragment> clip_triangles = sutherland_hodgeman(o1, o2, o3);
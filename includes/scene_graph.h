@@ -0,0 +1,149 @@
+#ifndef RAYTRACING_SCENE_GRAPH_H
+#define RAYTRACING_SCENE_GRAPH_H
+
+#include "string"
+#include "vector"
+#include "cstdint"
+#include "glm/glm.hpp"
+#include "frustum.h"
+
+// Node hierarchy of a model, flattened in depth first order so every parent comes before its children
+// and every subtree is a contiguous range. The per node state lives in parallel arrays that updates and
+// traversals walk front to back.
+//
+// World transforms, relative to the model, are cached. Changing a local transform marks the node dirty
+// and update() recomputes only the dirty subtrees, together with the bounds of their ancestors.
+class scene_graph {
+public:
+    struct node {
+        int parent = -1;
+        // one past the last node of the subtree
+        int subtree_end = 0;
+        // range in mesh_indices of the meshes drawn at this node
+        uint32_t first_mesh = 0;
+        uint32_t mesh_count = 0;
+    };
+
+    // Appends a node, parents have to be added before their children and subtrees one after another.
+    int add_node(int parent, const std::string &name, const glm::mat4 &local, const std::vector<unsigned int> &meshes) {
+        int index = static_cast<int>(nodes.size());
+        node n;
+        n.parent = parent;
+        n.subtree_end = index + 1;
+        n.first_mesh = static_cast<uint32_t>(mesh_indices.size());
+        n.mesh_count = static_cast<uint32_t>(meshes.size());
+        mesh_indices.insert(mesh_indices.end(), meshes.begin(), meshes.end());
+        nodes.push_back(n);
+        names.push_back(name);
+        locals.push_back(local);
+        worlds.push_back(local);
+        bounds.push_back(aabb::none());
+        dirty.push_back(1);
+        for (int p = parent; p >= 0; p = nodes[p].parent)
+            nodes[p].subtree_end = index + 1;
+        any_dirty = true;
+        return index;
+    }
+
+    size_t size() const {
+        return nodes.size();
+    }
+
+    const node &get_node(int i) const {
+        return nodes[i];
+    }
+
+    const std::string &get_name(int i) const {
+        return names[i];
+    }
+
+    // -1 if there is no such node
+    int find(const std::string &name) const {
+        for (size_t i = 0; i < names.size(); ++i)
+            if (names[i] == name)
+                return static_cast<int>(i);
+        return -1;
+    }
+
+    unsigned int get_mesh_index(int i, uint32_t k) const {
+        return mesh_indices[nodes[i].first_mesh + k];
+    }
+
+    const glm::mat4 &get_local_transform(int i) const {
+        return locals[i];
+    }
+
+    void set_local_transform(int i, const glm::mat4 &local) {
+        locals[i] = local;
+        dirty[i] = 1;
+        any_dirty = true;
+    }
+
+    // Valid after update().
+    const glm::mat4 &get_world_transform(int i) const {
+        return worlds[i];
+    }
+
+    // Model space bounds of the subtree, valid after update(). Empty when it has no meshes.
+    const aabb &get_bounds(int i) const {
+        return bounds[i];
+    }
+
+    // Recomputes the world transforms of dirty subtrees and the bounds they affect. mesh_bounds(m) is the
+    // object space box of mesh m.
+    template<class F>
+    void update(F &&mesh_bounds) {
+        if (!any_dirty)
+            return;
+        // dirty[i] is 1 for changed nodes and 2 for nodes whose bounds change through a descendant
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            int parent = nodes[i].parent;
+            if (dirty[i] == 1 || (parent >= 0 && dirty[parent] == 1)) {
+                worlds[i] = parent >= 0 ? worlds[parent] * locals[i] : locals[i];
+                dirty[i] = 1;
+            }
+        }
+        for (size_t r = nodes.size(); r-- > 0;) {
+            if (!dirty[r])
+                continue;
+            aabb box = aabb::none();
+            for (uint32_t k = 0; k < nodes[r].mesh_count; ++k)
+                box.expand(mesh_bounds(mesh_indices[nodes[r].first_mesh + k]).transformed(worlds[r]));
+            for (int c = static_cast<int>(r) + 1; c < nodes[r].subtree_end; c = nodes[c].subtree_end)
+                box.expand(bounds[c]);
+            bounds[r] = box;
+            int parent = nodes[r].parent;
+            if (parent >= 0 && !dirty[parent])
+                dirty[parent] = 2;
+        }
+        std::fill(dirty.begin(), dirty.end(), 0);
+        any_dirty = false;
+    }
+
+    // Calls visit(node) for every node with meshes whose subtree intersects model_frustum, a frustum in
+    // model space. Subtrees outside are skipped as a whole.
+    template<class F>
+    void traverse(const frustum &model_frustum, F &&visit) const {
+        for (int i = 0; i < static_cast<int>(nodes.size());) {
+            if (bounds[i].empty() || !model_frustum.intersects(bounds[i])) {
+                i = nodes[i].subtree_end;
+                continue;
+            }
+            if (nodes[i].mesh_count)
+                visit(i);
+            ++i;
+        }
+    }
+
+private:
+    std::vector<node> nodes;
+    std::vector<std::string> names;
+    std::vector<glm::mat4> locals;
+    std::vector<glm::mat4> worlds;
+    std::vector<aabb> bounds;
+    std::vector<unsigned char> dirty;
+    std::vector<unsigned int> mesh_indices;
+    bool any_dirty = false;
+};
+
+#endif //RAYTRACING_SCENE_GRAPH_H
@@ -6,6 +6,7 @@
 #include "glm/glm.hpp"
 #include "utils.h"
 #include "vertex.h"
+#include "vertex_streams.h"
 #include "framebuffer.h"
 #include "material.h"
 #include "vertex2fragment.h"
@@ -18,18 +19,28 @@ public:
         model_matrix = glm::mat4(1.0f);
         view_matrix = glm::mat4(1.0f);
         projection_matrix = glm::mat4(1.0f);
+        model_view_projection = glm::mat4(1.0f);
+        normal_matrix = glm::mat3(1.0f);
         _material = nullptr;
         dir_lights.clear();
         point_lights.clear();
         spot_lights.clear();
     }
 
-    ~shader() = default;
+    virtual ~shader() = default;
+
+    // Copy for another thread, state included.
+    virtual shared_ptr<shader> clone() const {
+        return make_shared<shader>(*this);
+    }
 
 public:
     glm::mat4 model_matrix{};
     glm::mat4 view_matrix{};
     glm::mat4 projection_matrix{};
+    // derived from the matrices above by their setters, the same for every vertex of a draw
+    glm::mat4 model_view_projection{};
+    glm::mat3 normal_matrix{};
     shared_ptr<material> _material;
     glm::vec3 camera_position;
 
@@ -45,13 +56,18 @@ public:
         project_pos.z = project_pos.z / project_pos.w;
     }
 
+    // Vertex attributes vertex_shader reads, meshes do not fetch the others.
+    virtual uint32_t get_vertex_attributes() const {
+        return attribute_position | attribute_normal | attribute_texcoord | attribute_color;
+    }
+
     virtual vertex2fragment vertex_shader(const vertex &a2v) {
         vertex2fragment v2f;
         v2f.world_pos = model_matrix * a2v.position;
         v2f.view_pos = view_matrix * v2f.world_pos;
-        v2f.projection_pos = projection_matrix * view_matrix * model_matrix * a2v.position;
+        v2f.projection_pos = model_view_projection * a2v.position;
         v2f.color = a2v.color;
-        v2f.normal = glm::mat3(glm::transpose(glm::inverse(model_matrix))) * a2v.normal;
+        v2f.normal = normal_matrix * a2v.normal;
         v2f.texcoord = a2v.texcoord;
         return v2f;
     }
@@ -61,13 +77,15 @@ public:
             //repeate
             float u = v2f.texcoord.x - std::floor(v2f.texcoord.x);
             float v = v2f.texcoord.y - std::floor(v2f.texcoord.y);
-            return _material->get_diffuse(u, v);
+            return _material->get_diffuse(u, v, v2f.texel_footprint);
         }
         return v2f.color;
     }
 
     void set_model_matrix(const glm::mat4 &model) {
         model_matrix = model;
+        normal_matrix = glm::mat3(glm::transpose(glm::inverse(model_matrix)));
+        model_view_projection = projection_matrix * view_matrix * model_matrix;
     }
 
     void set_material(shared_ptr<material> _mat) {
@@ -76,10 +94,12 @@ public:
 
     void set_view_matrix(const glm::mat4 &view) {
         view_matrix = view;
+        model_view_projection = projection_matrix * view_matrix * model_matrix;
     }
 
     void set_projection_matrix(const glm::mat4 &project) {
         projection_matrix = project;
+        model_view_projection = projection_matrix * view_matrix * model_matrix;
     }
 
     void set_camera_pos(const glm::vec3 &pos) {
@@ -107,13 +127,22 @@ public:
 
     ~blinn_phong_shader() = default;
 
+    shared_ptr<shader> clone() const override {
+        return make_shared<blinn_phong_shader>(*this);
+    }
+
+    // the vertex color is passed on but never shaded with
+    uint32_t get_vertex_attributes() const override {
+        return attribute_position | attribute_normal | attribute_texcoord;
+    }
+
     vertex2fragment vertex_shader(const vertex &a2v) override {
         vertex2fragment v2f;
         v2f.world_pos = model_matrix * a2v.position;
         v2f.view_pos = view_matrix * v2f.world_pos;
-        v2f.projection_pos = projection_matrix * view_matrix * model_matrix * a2v.position;
+        v2f.projection_pos = model_view_projection * a2v.position;
         v2f.color = a2v.color;
-        v2f.normal = glm::mat3(glm::transpose(glm::inverse(model_matrix))) * a2v.normal;
+        v2f.normal = normal_matrix * a2v.normal;
         v2f.texcoord = a2v.texcoord;
         return v2f;
     }
@@ -150,11 +179,11 @@ public:
         glm::vec3 reflect_dir = glm::reflect(-light_dir, normal);
         float spec = std::pow(std::fmax(glm::dot(view_dir, reflect_dir), 0.0), _material->shininess);
         // combine results
-        glm::vec3 albedo = glm::vec3(_material->get_diffuse(v2f.texcoord.x, v2f.texcoord.y));
+        glm::vec3 albedo = glm::vec3(_material->get_diffuse(v2f.texcoord.x, v2f.texcoord.y, v2f.texel_footprint));
         glm::vec3 ambient = dir_light_info->ambient * glm::vec3(albedo);
         glm::vec3 diffuse = dir_light_info->diffuse * diff * glm::vec3(albedo);
         glm::vec3 specular =
-                dir_light_info->specular * spec * glm::vec3(_material->get_specular(v2f.texcoord.x, v2f.texcoord.y));
+                dir_light_info->specular * spec * glm::vec3(_material->get_specular(v2f.texcoord.x, v2f.texcoord.y, v2f.texel_footprint));
         return (ambient + diffuse + specular);
     }
 
@@ -172,11 +201,11 @@ public:
         float attenuation =
                 1.0 / (_light->constant + _light->linear * distance + _light->quadratic * (distance * distance));
         // combine results
-        glm::vec3 albedo = glm::vec3(_material->get_diffuse(v2f.texcoord.x, v2f.texcoord.y));
+        glm::vec3 albedo = glm::vec3(_material->get_diffuse(v2f.texcoord.x, v2f.texcoord.y, v2f.texel_footprint));
         glm::vec3 ambient = _light->ambient * glm::vec3(albedo);
         glm::vec3 diffuse = _light->diffuse * diff * glm::vec3(albedo);
         glm::vec3 specular =
-                _light->specular * spec * glm::vec3(_material->get_specular(v2f.texcoord.x, v2f.texcoord.y));
+                _light->specular * spec * glm::vec3(_material->get_specular(v2f.texcoord.x, v2f.texcoord.y, v2f.texel_footprint));
         ambient *= attenuation;
         diffuse *= attenuation;
         specular *= attenuation;
@@ -201,11 +230,11 @@ public:
         float epsilon = _light->cut_off - _light->outer_cut_off;
         float intensity = clamp((theta - _light->outer_cut_off) / epsilon, 0.0, 1.0);
         // combine results
-        glm::vec3 albedo = glm::vec3(_material->get_diffuse(v2f.texcoord.x, v2f.texcoord.y));
+        glm::vec3 albedo = glm::vec3(_material->get_diffuse(v2f.texcoord.x, v2f.texcoord.y, v2f.texel_footprint));
         glm::vec3 ambient = _light->ambient * glm::vec3(albedo);
         glm::vec3 diffuse = _light->diffuse * diff * glm::vec3(albedo);
         glm::vec3 specular =
-                _light->specular * spec * glm::vec3(_material->get_specular(v2f.texcoord.x, v2f.texcoord.y));
+                _light->specular * spec * glm::vec3(_material->get_specular(v2f.texcoord.x, v2f.texcoord.y, v2f.texel_footprint));
         ambient *= attenuation * intensity;
         diffuse *= attenuation * intensity;
         specular *= attenuation * intensity;
@@ -0,0 +1,368 @@
+#ifndef RAYTRACING_TASK_SCHEDULER_H
+#define RAYTRACING_TASK_SCHEDULER_H
+
+#include "vector"
+#include "deque"
+#include "algorithm"
+#include "thread"
+#include "mutex"
+#include "atomic"
+#include "chrono"
+#include "cstdlib"
+#include "exception"
+#include "condition_variable"
+#include "functional"
+#include "future"
+#include "memory"
+#include "utility"
+
+// std::future of a task_scheduler task, which also knows the task so a waiting thread can run it itself.
+template<class T>
+class task_future : public std::future<T> {
+public:
+    task_future() = default;
+
+    task_future(std::future<T> &&result, const void *_owner) : std::future<T>(std::move(result)), owner(_owner) {}
+
+    const void *get_owner() const {
+        return owner;
+    }
+
+private:
+    const void *owner = nullptr;
+};
+
+// Work stealing scheduler shared by everything that runs in parallel: mesh import, texture decoding,
+// vertex shading of instances, resolve and image encoding. Every worker owns a deque, tasks it spawns go
+// to the back and it takes them from there again, newest first, while idle workers steal the oldest task
+// from the front of another's. Tasks from other threads go through a shared queue.
+//
+// Threads waiting on a task_group or a task_future run the tasks they wait for themselves if no worker
+// has taken them yet, and a waiting worker also runs its own deque, so tasks may wait on other tasks
+// without tying up a worker. Nothing else is picked up while waiting, a frame waiting on its resolve
+// never ends up encoding a png or decoding a texture.
+class task_scheduler {
+public:
+    using task = std::function<void()>;
+
+    // MINIRENDER_THREADS workers if set, else the set_thread_limit count, else one per core.
+    static task_scheduler &instance() {
+        static task_scheduler scheduler(default_thread_count());
+        return scheduler;
+    }
+
+    // Only has an effect before the first instance() call.
+    static void set_thread_limit(unsigned count) {
+        thread_limit() = count;
+    }
+
+    explicit task_scheduler(unsigned thread_count) {
+        thread_count = std::max(1u, thread_count);
+        for (unsigned i = 0; i < thread_count; ++i)
+            queues.push_back(std::make_unique<worker_queue>());
+        for (unsigned i = 0; i < thread_count; ++i)
+            workers.emplace_back([this, i] { worker_loop(static_cast<int>(i)); });
+    }
+
+    // Runs what is still queued, then joins.
+    ~task_scheduler() {
+        stopping = true;
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+        }
+        wake.notify_all();
+        for (auto &worker: workers)
+            worker.join();
+    }
+
+    task_scheduler(const task_scheduler &) = delete;
+
+    task_scheduler &operator=(const task_scheduler &) = delete;
+
+    unsigned size() const {
+        return static_cast<unsigned>(workers.size());
+    }
+
+    // owner tags the task for help_until, usually the group or future it belongs to.
+    void spawn(task run, const void *owner = nullptr) {
+        int self = current_worker();
+        if (self >= 0) {
+            std::lock_guard<std::mutex> lock(queues[self]->mutex);
+            queues[self]->jobs.push_back({std::move(run), owner});
+        } else {
+            std::lock_guard<std::mutex> lock(shared_mutex);
+            shared.push_back({std::move(run), owner});
+        }
+        ++queued;
+        // a worker about to sleep has announced itself before checking queued, so it sees the task or is
+        // woken here
+        if (sleeping > 0) {
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex);
+            }
+            wake.notify_one();
+        }
+    }
+
+    template<class F>
+    auto submit(F &&job) -> task_future<decltype(job())> {
+        using result_type = decltype(job());
+        auto packaged = std::make_shared<std::packaged_task<result_type()>>(std::forward<F>(job));
+        task_future<result_type> result(packaged->get_future(), packaged.get());
+        spawn([packaged] { (*packaged)(); }, packaged.get());
+        return result;
+    }
+
+    // future.get() that runs the task itself when no worker has started it yet.
+    template<class T>
+    T wait(task_future<T> &result) {
+        help_until(result.get_owner(),
+                   [&] { return result.wait_for(std::chrono::seconds(0)) == std::future_status::ready; },
+                   [&] { result.wait_for(idle_wait); });
+        return result.get();
+    }
+
+    // Runs queued tasks of owner, and on a worker its own deque, until ready() holds. idle() blocks briefly
+    // when there are none. Tasks of the own deque may wait in turn, past max_help_depth nested waits only
+    // tasks of owner are run, which are no deeper than the work being waited for.
+    template<class Ready, class Idle>
+    void help_until(const void *owner, Ready &&ready, Idle &&idle) {
+        const int self = current_worker();
+        const bool own_deque = identity().help_depth < max_help_depth;
+        ++identity().help_depth;
+        while (!ready())
+            if (!run_owned(self, owner, own_deque))
+                idle();
+        --identity().help_depth;
+    }
+
+    static constexpr std::chrono::microseconds idle_wait{100};
+    static constexpr int max_help_depth = 16;
+
+private:
+    struct job {
+        task run;
+        const void *owner;
+    };
+
+    struct worker_queue {
+        std::mutex mutex;
+        std::deque<job> jobs;
+    };
+
+    std::vector<std::unique_ptr<worker_queue>> queues;
+    std::mutex shared_mutex;
+    std::deque<job> shared;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> queued{0};
+    std::atomic<int> sleeping{0};
+    std::atomic<bool> stopping{false};
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+
+    static unsigned &thread_limit() {
+        static unsigned limit = 0;
+        return limit;
+    }
+
+    static unsigned default_thread_count() {
+        static char const *env_threads = getenv("MINIRENDER_THREADS");
+        if (env_threads != nullptr && std::atoi(env_threads) > 0)
+            return static_cast<unsigned>(std::atoi(env_threads));
+        if (thread_limit() > 0)
+            return thread_limit();
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    struct worker_identity {
+        const task_scheduler *scheduler = nullptr;
+        int index = -1;
+        int help_depth = 0;
+    };
+
+    static worker_identity &identity() {
+        static thread_local worker_identity current;
+        return current;
+    }
+
+    // index of the calling thread's deque, -1 for threads that are not workers of this scheduler
+    int current_worker() const {
+        return identity().scheduler == this ? identity().index : -1;
+    }
+
+    static bool pop(std::mutex &mutex, std::deque<job> &jobs, bool back, task &run) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (jobs.empty())
+            return false;
+        if (back) {
+            run = std::move(jobs.back().run);
+            jobs.pop_back();
+        } else {
+            run = std::move(jobs.front().run);
+            jobs.pop_front();
+        }
+        return true;
+    }
+
+    // oldest task of owner
+    static bool take(std::mutex &mutex, std::deque<job> &jobs, const void *owner, task &run) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+            if (it->owner == owner) {
+                run = std::move(it->run);
+                jobs.erase(it);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Own deque, then the shared queue, then the other deques.
+    bool run_any(int self) {
+        if (queued == 0)
+            return false;
+        task run;
+        bool found = pop(queues[self]->mutex, queues[self]->jobs, true, run) ||
+                     pop(shared_mutex, shared, false, run);
+        const size_t count = queues.size();
+        for (size_t i = 1; !found && i < count; ++i) {
+            worker_queue &victim = *queues[(size_t(self) + i) % count];
+            found = pop(victim.mutex, victim.jobs, false, run);
+        }
+        if (!found)
+            return false;
+        --queued;
+        run();
+        return true;
+    }
+
+    bool run_owned(int self, const void *owner, bool own_deque) {
+        if (queued == 0)
+            return false;
+        task run;
+        bool found = own_deque && self >= 0 && pop(queues[self]->mutex, queues[self]->jobs, true, run);
+        if (!found && owner != nullptr) {
+            found = take(shared_mutex, shared, owner, run);
+            for (size_t i = 0; !found && i < queues.size(); ++i)
+                found = take(queues[i]->mutex, queues[i]->jobs, owner, run);
+        }
+        if (!found)
+            return false;
+        --queued;
+        run();
+        return true;
+    }
+
+    void worker_loop(int index) {
+        identity() = {this, index, 0};
+        for (;;) {
+            if (run_any(index))
+                continue;
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            ++sleeping;
+            wake.wait(lock, [this] { return stopping || queued > 0; });
+            --sleeping;
+            if (stopping && queued == 0)
+                return;
+        }
+    }
+};
+
+// Tasks that can be waited on together. run_after makes a task depend on everything another group has
+// queued, which is how pipelines keep their stages in order. Exceptions are passed on by wait().
+class task_group {
+public:
+    explicit task_group(task_scheduler &_scheduler = task_scheduler::instance()) : scheduler(_scheduler),
+                                                                                  shared(std::make_shared<state>()) {}
+
+    ~task_group() {
+        help_until_done();
+    }
+
+    task_group(const task_group &) = delete;
+
+    task_group &operator=(const task_group &) = delete;
+
+    template<class F>
+    void run(F &&job) {
+        ++shared->pending;
+        scheduler.spawn(wrap(std::forward<F>(job)), shared.get());
+    }
+
+    // job is queued once predecessor has no unfinished tasks, right away if it has none now.
+    template<class F>
+    void run_after(task_group &predecessor, F &&job) {
+        ++shared->pending;
+        task_scheduler::task wrapped = wrap(std::forward<F>(job));
+        {
+            std::lock_guard<std::mutex> lock(predecessor.shared->mutex);
+            if (predecessor.shared->pending > 0) {
+                predecessor.shared->continuations.push_back({std::move(wrapped), shared.get()});
+                return;
+            }
+        }
+        scheduler.spawn(std::move(wrapped), shared.get());
+    }
+
+    bool done() const {
+        return shared->pending == 0;
+    }
+
+    // Runs tasks of the group until all of them have finished, then rethrows the first exception one of
+    // them threw.
+    void wait() {
+        help_until_done();
+        std::exception_ptr error;
+        {
+            std::lock_guard<std::mutex> lock(shared->mutex);
+            std::swap(error, shared->error);
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+private:
+    struct state {
+        std::atomic<size_t> pending{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+        // tasks of other groups waiting for this one, with the group they belong to
+        std::vector<std::pair<task_scheduler::task, const void *>> continuations;
+        std::exception_ptr error;
+    };
+
+    task_scheduler &scheduler;
+    std::shared_ptr<state> shared;
+
+    template<class F>
+    task_scheduler::task wrap(F &&job) {
+        return [group = shared, &scheduler = scheduler, job = std::forward<F>(job)]() mutable {
+            try {
+                job();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(group->mutex);
+                if (!group->error)
+                    group->error = std::current_exception();
+            }
+            if (--group->pending > 0)
+                return;
+            std::vector<std::pair<task_scheduler::task, const void *>> continuations;
+            {
+                std::lock_guard<std::mutex> lock(group->mutex);
+                continuations.swap(group->continuations);
+                group->finished.notify_all();
+            }
+            for (auto &continuation: continuations)
+                scheduler.spawn(std::move(continuation.first), continuation.second);
+        };
+    }
+
+    void help_until_done() {
+        scheduler.help_until(shared.get(), [this] { return shared->pending == 0; }, [this] {
+            std::unique_lock<std::mutex> lock(shared->mutex);
+            shared->finished.wait_for(lock, task_scheduler::idle_wait, [this] { return shared->pending == 0; });
+        });
+    }
+};
+
+#endif //RAYTRACING_TASK_SCHEDULER_H
@@ -3,17 +3,29 @@
 
 #include "glm/glm.hpp"
 #include "string"
+#include "cstring"
 #include "utils.h"
+#include "texture_cache.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MINIRENDER_SSE2
+#endif
 
 using namespace std;
 
+enum class texture_filter {
+    nearest,
+    bilinear
+};
+
 class texture {
 public:
     unsigned int id;
     string type;
     string path;
 
-    virtual glm::vec4 get_value(double u, double v) const = 0;
+    virtual glm::vec4 get_value(double u, double v, float texel_footprint = 0.0f) const = 0;
 };
 
 class solid_color : public texture {
@@ -25,7 +37,7 @@ public:
     solid_color(float red, float green, float blue)
             : solid_color(glm::vec4(red, green, blue, 1.0f)) {}
 
-    glm::vec4 get_value(double u, double v) const override {
+    glm::vec4 get_value(double, double, float) const override {
         return color_value;
     }
 
@@ -37,39 +49,50 @@ class image_texture : public texture {
 public:
     image_texture(const string &path) {
         this->path = path;
-        color_data = stbi_load(
-                path.c_str(), &width, &height, &channel, 0);
+        record = texture_cache::instance().register_image(path);
 
         std::cout << "load texture '" << path << "' .\n";
-        if (!color_data) {
+        if (!record->valid) {
             std::cerr << "ERROR: Could not load texture image file '" << path << "'.\n";
-            width = height = 0;
+            record = nullptr;
         }
     }
 
-    image_texture() : color_data(nullptr), width(0), height(0), channel(0) {}
+    image_texture() : record(nullptr) {}
 
-    ~image_texture() {
-        if (color_data)
-            stbi_image_free(color_data);
-        color_data = nullptr;
+    // filter used by textures created afterwards
+    static texture_filter &default_filter() {
+        static texture_filter filter = texture_filter::nearest;
+        return filter;
     }
 
-private:
-    int width, height, channel;
-    unsigned char *color_data;
-
-    glm::vec4 set_color(unsigned char *data) {
-        if (color_data)
-            delete[] color_data;
-        color_data = new unsigned char[width * height * channel];
-        memcpy(color_data, data, width * height * channel);
+    texture_filter filter = default_filter();
+
+    void prefetch() {
+        if (record)
+            texture_cache::instance().prefetch(*record);
+    }
+
+    // Picks the mip level from the texel area covered by one pixel; texel_footprint is in uv^2 per pixel.
+    int select_level(float texel_footprint) const {
+        if (texel_footprint <= 0.0f)
+            return 0;
+        float lod = 0.5f * std::log2(texel_footprint * record->width * record->height);
+        int level = static_cast<int>(std::floor(lod + 0.5f));
+        return std::clamp(level, 0, static_cast<int>(record->levels.size()) - 1);
     }
 
-    glm::vec4 get_value(double u, double v) const override {
+private:
+    texture_cache::image_record *record;
+
+    glm::vec4 get_value(double u, double v, float texel_footprint) const override {
         // If we have no texture data, then return solid cyan as a debugging aid.
-        if (color_data == nullptr)
-            return glm::vec4(0.f, 1.0f, 1.0f, 1.0f);;
+        if (record == nullptr)
+            return glm::vec4(0.f, 1.0f, 1.0f, 1.0f);
+
+        const mip_level *mip = texture_cache::instance().fetch(*record, select_level(texel_footprint));
+        if (mip == nullptr)
+            return glm::vec4(0.f, 1.0f, 1.0f, 1.0f);
 
          //reapte
 //        float u = u - std::floor(u);
@@ -79,19 +102,86 @@ private:
         u = clamp(u, 0.0f, 1.0f);
         v = 1.0f - clamp(v, 0.0f, 1.0f);  // Flip V to image coordinates
 
-        auto i = static_cast<int>(u * width);
-        auto j = static_cast<int>(v * height);
+        if (filter == texture_filter::bilinear)
+            return sample_bilinear(*mip, u, v);
+
+        auto i = static_cast<int>(u * mip->width);
+        auto j = static_cast<int>(v * mip->height);
 
         // Clamp integer mapping, since actual coordinates should be less than 1.0
-        if (i >= width) i = width - 1;
-        if (j >= height) j = height - 1;
+        if (i >= mip->width) i = mip->width - 1;
+        if (j >= mip->height) j = mip->height - 1;
 
         const float color_scale = 1.0 / 255.0;
-        auto pixel_data = color_data + j * width * channel + i * channel;
-        glm::vec4 color(1.0f);
-        for (int k = 0; k < channel; ++k) {
-            color[k] = *pixel_data++ * color_scale;
+        auto pixel_data = mip->texels + (j * mip->width + i) * 4;
+        return glm::vec4(pixel_data[0], pixel_data[1], pixel_data[2], pixel_data[3]) * color_scale;
+    }
+
+    // Filters the four RGBA8 texels with 8 fractional bit weights in 16 bit lanes, every
+    // intermediate stays below 2^16 so the whole blend is integer adds, multiplies and shifts.
+    static glm::vec4 sample_bilinear(const mip_level &mip, double u, double v) {
+        // texel position in 24.8 fixed point, relative to texel centers
+        int x = static_cast<int>(static_cast<float>(u) * mip.width * 256.0f) - 128;
+        int y = static_cast<int>(static_cast<float>(v) * mip.height * 256.0f) - 128;
+        int x0 = x >> 8;
+        int y0 = y >> 8;
+        int wx = x & 255;
+        int wy = y & 255;
+        // clamp to edge by moving the 2x2 footprint inside the image and pushing all weight to one side
+        if (x0 < 0) {
+            x0 = 0;
+            wx = 0;
+        } else if (x0 >= mip.width - 1) {
+            x0 = std::max(mip.width - 2, 0);
+            wx = mip.width > 1 ? 256 : 0;
+        }
+        if (y0 < 0) {
+            y0 = 0;
+            wy = 0;
+        } else if (y0 >= mip.height - 1) {
+            y0 = std::max(mip.height - 2, 0);
+            wy = mip.height > 1 ? 256 : 0;
+        }
+        int x1 = std::min(x0 + 1, mip.width - 1);
+        int y1 = std::min(y0 + 1, mip.height - 1);
+
+        const unsigned char *row0 = mip.texels + y0 * mip.width * 4;
+        const unsigned char *row1 = mip.texels + y1 * mip.width * 4;
+        glm::vec4 color;
+#ifdef MINIRENDER_SSE2
+        __m128i top, bottom;
+        if (x1 != x0) {
+            top = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(row0 + x0 * 4));
+            bottom = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(row1 + x0 * 4));
+        } else {
+            int left, right;
+            std::memcpy(&left, row0 + x0 * 4, sizeof(left));
+            std::memcpy(&right, row1 + x0 * 4, sizeof(right));
+            top = _mm_set1_epi32(left);
+            bottom = _mm_set1_epi32(right);
+        }
+        const __m128i zero = _mm_setzero_si128();
+        // [left texel | right texel] widened to 16 bit
+        top = _mm_unpacklo_epi8(top, zero);
+        bottom = _mm_unpacklo_epi8(bottom, zero);
+        __m128i weight_x = _mm_unpacklo_epi64(_mm_set1_epi16(static_cast<short>(256 - wx)),
+                                              _mm_set1_epi16(static_cast<short>(wx)));
+        top = _mm_mullo_epi16(top, weight_x);
+        bottom = _mm_mullo_epi16(bottom, weight_x);
+        top = _mm_srli_epi16(_mm_add_epi16(top, _mm_srli_si128(top, 8)), 8);
+        bottom = _mm_srli_epi16(_mm_add_epi16(bottom, _mm_srli_si128(bottom, 8)), 8);
+        __m128i blend = _mm_add_epi16(_mm_mullo_epi16(top, _mm_set1_epi16(static_cast<short>(256 - wy))),
+                                      _mm_mullo_epi16(bottom, _mm_set1_epi16(static_cast<short>(wy))));
+        blend = _mm_srli_epi16(_mm_add_epi16(blend, _mm_set1_epi16(128)), 8);
+        __m128 result = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(blend, zero)), _mm_set1_ps(1.0f / 255.0f));
+        _mm_storeu_ps(&color[0], result);
+#else
+        for (int k = 0; k < 4; ++k) {
+            int top = (row0[x0 * 4 + k] * (256 - wx) + row0[x1 * 4 + k] * wx) >> 8;
+            int bottom = (row1[x0 * 4 + k] * (256 - wx) + row1[x1 * 4 + k] * wx) >> 8;
+            color[k] = ((top * (256 - wy) + bottom * wy + 128) >> 8) * (1.0f / 255.0f);
         }
+#endif
         return color;
     }
 
@@ -0,0 +1,398 @@
+#ifndef RAYTRACING_TEXTURE_CACHE_H
+#define RAYTRACING_TEXTURE_CACHE_H
+
+#include "string"
+#include "algorithm"
+#include "vector"
+#include "memory"
+#include "cstdlib"
+#include "unordered_map"
+#include "chrono"
+#include "atomic"
+#include "mutex"
+#include "utils.h"
+#include "task_scheduler.h"
+#include "mipmap.h"
+#include "texture_disk_cache.h"
+
+// Process wide texture residency manager.
+// Images are registered by path (only the header is read). Mip chains come from the on-disk cache or
+// are decoded on the task scheduler, either ahead of time through prefetch() or on the first miss, and
+// the least recently used levels are evicted once the byte budget is exceeded. Chains still waiting to be
+// sampled count against the budget too and are dropped before any resident level.
+// fetch() may be called from several threads, hits only read atomics and misses take the mutex.
+class texture_cache {
+public:
+    struct level_slot {
+        std::unique_ptr<mip_level> data;
+        // data as seen by the hit path, set and cleared under the mutex
+        std::atomic<const mip_level *> view{nullptr};
+        std::atomic<uint64_t> last_used{0};
+
+        level_slot() = default;
+
+        // only used while the record is registered, before any other thread can see it
+        level_slot(level_slot &&other) noexcept
+                : data(std::move(other.data)), view(other.view.load()), last_used(other.last_used.load()) {}
+    };
+
+    struct image_record {
+        std::string path;
+        int width = 0;
+        int height = 0;
+        int channel = 0;
+        bool valid = false;
+        std::vector<level_slot> levels;
+        task_future<std::shared_ptr<mip_chain>> pending;
+        // set when the pending decode is dropped, it then skips what it has not done yet
+        std::shared_ptr<std::atomic<bool>> pending_cancelled;
+        // the whole chain, counted as pending until the first miss takes it
+        size_t pending_bytes = 0;
+    };
+
+    struct statistics {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t decodes = 0;
+        uint64_t evictions = 0;
+        uint64_t fallbacks = 0;
+    };
+
+    static texture_cache &instance() {
+        static texture_cache cache;
+        return cache;
+    }
+
+    // The scheduler may have been constructed first and then outlives the disk cache, so queued decodes,
+    // dropped ones included, have to finish here. The workers run them, a future that is not ready yet has
+    // a live scheduler.
+    ~texture_cache() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &image: images)
+            drop_pending(*image.second);
+        for (auto &decode: dropped)
+            decode.wait();
+    }
+
+    // While one is alive textures may be fetched from several threads. Levels evicted meanwhile can still
+    // be sampled by another thread, they are freed when the last one ends.
+    class concurrent_fetches {
+    public:
+        explicit concurrent_fetches(texture_cache &cache) : cache(cache) {
+            std::lock_guard<std::mutex> lock(cache.mutex);
+            ++cache.concurrent;
+        }
+
+        ~concurrent_fetches() {
+            std::lock_guard<std::mutex> lock(cache.mutex);
+            if (--cache.concurrent == 0)
+                cache.retired.clear();
+        }
+
+        concurrent_fetches(const concurrent_fetches &) = delete;
+        concurrent_fetches &operator=(const concurrent_fetches &) = delete;
+
+    private:
+        texture_cache &cache;
+    };
+
+    void set_budget(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = bytes;
+        make_room(0);
+    }
+
+    size_t get_budget() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return budget;
+    }
+
+    size_t get_resident_bytes() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return resident_bytes;
+    }
+
+    size_t get_pending_bytes() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return pending_bytes;
+    }
+
+    statistics get_statistics() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        statistics current = stats;
+        current.hits = hits;
+        return current;
+    }
+
+    image_record *register_image(const std::string &path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = images.find(path);
+        if (found != images.end())
+            return found->second.get();
+
+        auto record = std::make_unique<image_record>();
+        record->path = path;
+        record->valid = stbi_info(path.c_str(), &record->width, &record->height, &record->channel) != 0;
+        if (record->valid) {
+            int levels = 1;
+            for (int size = std::max(record->width, record->height); size > 1; size /= 2)
+                ++levels;
+            record->levels.resize(levels);
+        }
+        return (images[path] = std::move(record)).get();
+    }
+
+    // Returns the requested level, loading it on a miss. When the level cannot be made resident the
+    // closest coarser resident level is returned instead, nullptr only if nothing is resident at all.
+    const mip_level *fetch(image_record &record, int level) {
+        level_slot &slot = record.levels[level];
+        if (const mip_level *mip = slot.view.load(std::memory_order_acquire)) {
+            hits.fetch_add(1, std::memory_order_relaxed);
+            touch(slot);
+            return mip;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        return fetch_miss(record, level);
+    }
+
+    // Starts decoding the whole chain on the task scheduler, the result is picked up by the first miss.
+    // Skipped when the chain does not fit in the budget next to what is resident and pending, the first
+    // miss decodes it then.
+    void prefetch(image_record &record) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!record.valid || record.pending.valid())
+            return;
+        size_t bytes = chain_bytes(record);
+        if (resident_bytes + pending_bytes + bytes > budget)
+            return;
+        start_decode(record, bytes);
+    }
+
+    void evict_all() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &image: images) {
+            drop_pending(*image.second);
+            for (auto &slot: image.second->levels)
+                evict(slot);
+        }
+    }
+
+private:
+    mutable std::mutex mutex;
+    size_t budget;
+    size_t resident_bytes = 0;
+    size_t pending_bytes = 0;
+    std::atomic<uint64_t> clock{0};
+    std::atomic<uint64_t> hits{0};
+    statistics stats;
+    // live concurrent_fetches and the levels evicted while there were any
+    int concurrent = 0;
+    std::vector<std::unique_ptr<mip_level>> retired;
+    std::unordered_map<std::string, std::unique_ptr<image_record>> images;
+    // cancelled decodes that may still be queued or running
+    std::vector<task_future<std::shared_ptr<mip_chain>>> dropped;
+
+    texture_cache() {
+        // 1 GiB unless overridden, e.g. MINIRENDER_TEXTURE_BUDGET_MB=256 on fixed memory containers
+        static char const *env_budget = getenv("MINIRENDER_TEXTURE_BUDGET_MB");
+        budget = env_budget != nullptr ? std::strtoull(env_budget, nullptr, 10) << 20 : size_t(1) << 30;
+        // decode jobs use the disk cache, construct it first so it outlives this cache at exit
+        texture_disk_cache::instance();
+        task_scheduler::instance();
+    }
+
+    static size_t chain_bytes(const image_record &record) {
+        size_t bytes = 0;
+        int width = record.width, height = record.height;
+        for (size_t l = 0; l < record.levels.size(); ++l) {
+            bytes += size_t(width) * height * 4;
+            width = std::max(1, width / 2);
+            height = std::max(1, height / 2);
+        }
+        return bytes;
+    }
+
+    void start_decode(image_record &record, size_t bytes) {
+        std::string path = record.path;
+        size_t level_count = record.levels.size();
+        auto cancelled = std::make_shared<std::atomic<bool>>(false);
+        record.pending = task_scheduler::instance().submit([path, level_count, cancelled] {
+            return decode(path, level_count, *cancelled);
+        });
+        record.pending_cancelled = cancelled;
+        record.pending_bytes = bytes;
+        pending_bytes += bytes;
+    }
+
+    // The decode is cancelled, one that already runs stops at its next step and frees what it made.
+    void drop_pending(image_record &record) {
+        if (!record.pending.valid())
+            return;
+        *record.pending_cancelled = true;
+        dropped.push_back(std::move(record.pending));
+        record.pending = {};
+        record.pending_cancelled.reset();
+        pending_bytes -= record.pending_bytes;
+        record.pending_bytes = 0;
+        dropped.erase(std::remove_if(dropped.begin(), dropped.end(), [](const auto &decode) {
+            return decode.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }), dropped.end());
+    }
+
+    // An empty chain if the image cannot be read or the decode was cancelled.
+    static std::shared_ptr<mip_chain> decode(const std::string &path, size_t level_count,
+                                             const std::atomic<bool> &cancelled) {
+        auto chain = std::make_shared<mip_chain>();
+        if (cancelled)
+            return chain;
+        std::shared_ptr<mip_chain> cached = texture_disk_cache::instance().load(path);
+        if (cached && cached->size() == level_count)
+            return cached;
+
+        int width, height, channel;
+        unsigned char *data = stbi_load(path.c_str(), &width, &height, &channel, 4);
+        if (!data || cancelled) {
+            stbi_image_free(data);
+            return chain;
+        }
+        chain->push_back(std::make_unique<mip_level>(width, height));
+        std::copy(data, data + width * height * 4, chain->front()->storage.begin());
+        stbi_image_free(data);
+        while (chain->size() < level_count && !cancelled)
+            chain->push_back(chain->back()->downsample());
+        if (cancelled)
+            return std::make_shared<mip_chain>();
+        texture_disk_cache::instance().store(path, *chain);
+        return chain;
+    }
+
+    // Stamps the slot as most recently used. The clock only advances when another slot was used since, so
+    // the order is the same as stamping every use, without all threads bumping the clock on every hit.
+    void touch(level_slot &slot) {
+        if (slot.last_used.load(std::memory_order_relaxed) != clock.load(std::memory_order_relaxed))
+            slot.last_used.store(clock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    const mip_level *fetch_miss(image_record &record, int level) {
+        // another thread may have loaded it while this one waited for the mutex
+        if (record.levels[level].data) {
+            hits.fetch_add(1, std::memory_order_relaxed);
+            touch(record.levels[level]);
+            return record.levels[level].data.get();
+        }
+        ++stats.misses;
+        if (record.valid && !downsample_resident(record, level)) {
+            if (!record.pending.valid())
+                start_decode(record, chain_bytes(record));
+            // keep sampling a coarser resident level while the decode is still in flight
+            bool ready = record.pending.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            if (ready || closest_resident(record, level) == nullptr)
+                integrate(record, level);
+        }
+
+        if (record.levels[level].data) {
+            touch(record.levels[level]);
+            return record.levels[level].data.get();
+        }
+        ++stats.fallbacks;
+        return closest_resident(record, level);
+    }
+
+    const mip_level *closest_resident(image_record &record, int level) {
+        for (int l = level + 1; l < static_cast<int>(record.levels.size()); ++l) {
+            if (record.levels[l].data) {
+                touch(record.levels[l]);
+                return record.levels[l].data.get();
+            }
+        }
+        for (int l = level - 1; l >= 0; --l) {
+            if (record.levels[l].data) {
+                touch(record.levels[l]);
+                return record.levels[l].data.get();
+            }
+        }
+        return nullptr;
+    }
+
+    // cheap path: filter down from a finer level that is still resident
+    bool downsample_resident(image_record &record, int level) {
+        for (int l = level - 1; l >= 0; --l) {
+            if (!record.levels[l].data)
+                continue;
+            std::unique_ptr<mip_level> mip = record.levels[l].data->downsample();
+            while (++l < level)
+                mip = mip->downsample();
+            insert(record.levels[level], std::move(mip));
+            return true;
+        }
+        return false;
+    }
+
+    void integrate(image_record &record, int level) {
+        std::shared_ptr<mip_chain> chain = task_scheduler::instance().wait(record.pending);
+        pending_bytes -= record.pending_bytes;
+        record.pending_bytes = 0;
+        ++stats.decodes;
+        if (chain->empty()) {
+            std::cerr << "ERROR: Could not load texture image file '" << record.path << "'.\n";
+            record.valid = false;
+            return;
+        }
+        // coarser levels are cheap and serve as fallbacks, insert them first so the requested
+        // level ends up most recently used
+        for (int l = static_cast<int>(chain->size()) - 1; l >= level; --l) {
+            if (!record.levels[l].data)
+                insert(record.levels[l], std::move((*chain)[l]));
+        }
+        // finer levels are kept only while they fit, as the first candidates for eviction
+        for (int l = level - 1; l >= 0; --l) {
+            if (!record.levels[l].data)
+                insert(record.levels[l], std::move((*chain)[l]), true);
+        }
+    }
+
+    void insert(level_slot &slot, std::unique_ptr<mip_level> mip, bool speculative = false) {
+        if (mip->bytes() > budget || (speculative && resident_bytes + pending_bytes + mip->bytes() > budget))
+            return;
+        make_room(mip->bytes());
+        resident_bytes += mip->bytes();
+        slot.data = std::move(mip);
+        slot.view.store(slot.data.get(), std::memory_order_release);
+        slot.last_used = speculative ? 0 : ++clock;
+    }
+
+    void make_room(size_t bytes) {
+        // pending chains have not been sampled yet, they go first
+        for (auto &image: images) {
+            if (resident_bytes + pending_bytes + bytes <= budget)
+                return;
+            drop_pending(*image.second);
+        }
+        while (resident_bytes + bytes > budget) {
+            level_slot *victim = nullptr;
+            for (auto &image: images) {
+                for (auto &slot: image.second->levels) {
+                    if (slot.data && (victim == nullptr || slot.last_used < victim->last_used))
+                        victim = &slot;
+                }
+            }
+            if (victim == nullptr)
+                return;
+            evict(*victim);
+            ++stats.evictions;
+        }
+    }
+
+    void evict(level_slot &slot) {
+        if (!slot.data)
+            return;
+        resident_bytes -= slot.data->bytes();
+        slot.view.store(nullptr, std::memory_order_release);
+        if (concurrent > 0)
+            retired.push_back(std::move(slot.data));
+        else
+            slot.data.reset();
+    }
+};
+
+#endif //RAYTRACING_TEXTURE_CACHE_H
@@ -0,0 +1,162 @@
+#ifndef RAYTRACING_TEXTURE_DISK_CACHE_H
+#define RAYTRACING_TEXTURE_DISK_CACHE_H
+
+#include "string"
+#include "cstdio"
+#include "cstdlib"
+#include "cstring"
+#include "filesystem"
+#include "utils.h"
+#include "mipmap.h"
+#include "mapped_file.h"
+
+// Directory of decoded, mipmapped textures.
+// Each entry is named after a hash of the source path, mtime, size and bytes and holds a header, a level
+// table and the texels of every level, each level starting on its own page. Entries are opened with
+// mmap, so a warm start decodes nothing and only the sampled pages are ever read. The source is still
+// read once per lookup to hash it, a replaced file with the same size and mtime is not served stale.
+class texture_disk_cache {
+public:
+    enum texel_layout : uint32_t {
+        layout_rgba8 = 1
+    };
+
+    struct file_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t layout;
+        uint64_t key;
+        int64_t source_mtime;
+        uint64_t source_size;
+        uint64_t source_hash;
+        uint32_t width;
+        uint32_t height;
+        uint32_t level_count;
+        uint32_t reserved;
+    };
+
+    struct file_level {
+        uint64_t offset;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    static constexpr uint32_t format_version = 2;
+    static constexpr size_t level_alignment = 4096;
+
+    static texture_disk_cache &instance() {
+        static texture_disk_cache cache;
+        return cache;
+    }
+
+    // An empty directory disables the cache.
+    void set_directory(const std::string &dir) {
+        directory = dir;
+    }
+
+    const std::string &get_directory() const {
+        return directory;
+    }
+
+    std::shared_ptr<mip_chain> load(const std::string &source_path) const {
+        file_header expected{};
+        std::string entry = entry_path(source_path, expected);
+        if (entry.empty())
+            return nullptr;
+        std::shared_ptr<mapped_file> file = mapped_file::open(entry);
+        if (!file || file->size() < sizeof(file_header))
+            return nullptr;
+
+        file_header header{};
+        std::memcpy(&header, file->data(), sizeof(header));
+        if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+            header.version != format_version || header.layout != layout_rgba8 || header.key != expected.key ||
+            header.source_mtime != expected.source_mtime || header.source_size != expected.source_size ||
+            header.source_hash != expected.source_hash ||
+            file->size() < sizeof(file_header) + header.level_count * sizeof(file_level))
+            return nullptr;
+
+        auto chain = std::make_shared<mip_chain>();
+        for (uint32_t l = 0; l < header.level_count; ++l) {
+            file_level level{};
+            std::memcpy(&level, file->data() + sizeof(file_header) + l * sizeof(file_level), sizeof(level));
+            if (level.offset + size_t(level.width) * level.height * 4 > file->size())
+                return nullptr;
+            chain->push_back(std::make_unique<mip_level>(level.width, level.height, file, level.offset));
+        }
+        return chain;
+    }
+
+    void store(const std::string &source_path, const mip_chain &chain) const {
+        file_header header{};
+        std::string entry = entry_path(source_path, header);
+        if (entry.empty() || chain.empty())
+            return;
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+
+        header.version = format_version;
+        header.layout = layout_rgba8;
+        header.width = chain.front()->width;
+        header.height = chain.front()->height;
+        header.level_count = static_cast<uint32_t>(chain.size());
+
+        std::vector<file_level> levels;
+        uint64_t offset = align(sizeof(file_header) + chain.size() * sizeof(file_level));
+        for (const auto &mip: chain) {
+            levels.push_back({offset, static_cast<uint32_t>(mip->width), static_cast<uint32_t>(mip->height)});
+            offset = align(offset + mip->bytes());
+        }
+
+        bool stored = mapped_file::write_atomically(entry, [&](std::ofstream &out) {
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char *>(levels.data()), levels.size() * sizeof(file_level));
+            for (size_t l = 0; l < chain.size(); ++l) {
+                out.seekp(levels[l].offset);
+                out.write(reinterpret_cast<const char *>(chain[l]->texels), chain[l]->bytes());
+            }
+            return bool(out);
+        });
+        if (!stored)
+            std::cerr << "WARNING: Could not write texture cache entry '" << entry << "'.\n";
+    }
+
+private:
+    std::string directory;
+
+    texture_disk_cache() {
+        static char const *env_dir = getenv("MINIRENDER_CACHE_DIR");
+        directory = env_dir != nullptr ? std::string(env_dir) : FileSystem::getPath("cache");
+        if (!directory.empty())
+            directory += "/textures";
+    }
+
+    static uint64_t align(uint64_t offset) {
+        return (offset + level_alignment - 1) / level_alignment * level_alignment;
+    }
+
+    // Fills in the identifying part of the header, returns an empty path if the source is missing or empty.
+    std::string entry_path(const std::string &source_path, file_header &header) const {
+        struct stat info{};
+        if (directory.empty() || stat(source_path.c_str(), &info) != 0)
+            return "";
+        std::shared_ptr<mapped_file> source = mapped_file::open(source_path);
+        if (!source)
+            return "";
+        std::memcpy(header.magic, "MRTEX\0\0\0", sizeof(header.magic));
+        header.source_mtime = static_cast<int64_t>(info.st_mtime);
+        header.source_size = static_cast<uint64_t>(info.st_size);
+        header.source_hash = fnv1a_64(source->data(), source->size());
+        uint64_t key = fnv1a_64(source_path.data(), source_path.size());
+        key = fnv1a_64(&header.source_mtime, sizeof(header.source_mtime), key);
+        key = fnv1a_64(&header.source_size, sizeof(header.source_size), key);
+        key = fnv1a_64(&header.source_hash, sizeof(header.source_hash), key);
+        header.key = key;
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.mrtex", static_cast<unsigned long long>(key));
+        return directory + "/" + name;
+    }
+};
+
+#endif //RAYTRACING_TEXTURE_DISK_CACHE_H
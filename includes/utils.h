@@ -44,6 +44,23 @@ inline int random_int(int min, int max) {
     return static_cast<int>(random_double(min, max + 1));
 }
 
+// 64 bit FNV-1a, pass the previous result as seed to hash several buffers
+inline uint64_t fnv1a_64(const void *data, size_t size, uint64_t seed = 14695981039346656037ull) {
+    auto bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i)
+        seed = (seed ^ bytes[i]) * 1099511628211ull;
+    return seed;
+}
+
+// Element index of the radical inverse (Halton) sequence in the given base, in [0, 1).
+inline float halton(int index, int base) {
+    float result = 0.0f;
+    float fraction = 1.0f / base;
+    for (; index > 0; index /= base, fraction /= base)
+        result += fraction * (index % base);
+    return result;
+}
+
 //glm::vec3 reflect(const glm::vec3 &light_dir, const glm::vec3 &normal) {
 //    return light_dir - 2 * glm::dot(normal, light_dir) * normal;
 //}
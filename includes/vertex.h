@@ -39,7 +39,7 @@ public:
     ) :
             position(_pos, 1.0f), color(_color), texcoord(_tex), normal(_normal) {}
 
-    vertex(const vertex &v) : position(v.position), color(v.color), texcoord(v.texcoord), normal(v.normal) {}
+    vertex(const vertex &v) = default;
 };
 
 #endif //RAYTRACING_VERTEX_H
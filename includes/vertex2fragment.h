@@ -13,6 +13,8 @@ public:
     glm::vec4 color;
     glm::vec2 texcoord;
     glm::vec3 normal;
+    // uv area covered by one pixel, used for mip selection
+    float texel_footprint = 0.0f;
 
     vertex2fragment() = default;
 
@@ -28,8 +30,9 @@ public:
             world_pos(_wPos), projection_pos(_pPos), color(_color), texcoord(_tex), normal(_normal) {}
 
     vertex2fragment(const vertex2fragment &v) :
-            world_pos(v.world_pos), projection_pos(v.projection_pos), color(v.color), texcoord(v.texcoord),
-            normal(v.normal) {}
+            world_pos(v.world_pos), view_pos(v.view_pos), projection_pos(v.projection_pos),
+            viewport_pos(v.viewport_pos), color(v.color), texcoord(v.texcoord), normal(v.normal),
+            texel_footprint(v.texel_footprint) {}
 
     static vertex2fragment lerp(const vertex2fragment &v1, const vertex2fragment &v2, const float &factor) {
         vertex2fragment result;
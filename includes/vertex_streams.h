@@ -0,0 +1,306 @@
+#ifndef RAYTRACING_VERTEX_STREAMS_H
+#define RAYTRACING_VERTEX_STREAMS_H
+
+#include "vector"
+#include "memory"
+#include "cmath"
+#include "cstring"
+#include "cstdint"
+#include "algorithm"
+#include "glm/glm.hpp"
+#include "cstddef"
+#include "utils.h"
+#include "vertex.h"
+#include "array_view.h"
+#include "geometry_arena.h"
+#include "frustum.h"
+
+// Vertex attributes, a shader declares the ones it reads and a mesh the ones it stores.
+enum vertex_attribute : uint32_t {
+    attribute_position = 1u << 0,
+    attribute_normal = 1u << 1,
+    attribute_texcoord = 1u << 2,
+    attribute_color = 1u << 3,
+    attribute_tangent = 1u << 4,
+    attribute_bitangent = 1u << 5,
+};
+
+constexpr int vertex_attribute_count = 6;
+constexpr uint32_t all_vertex_attributes = (1u << vertex_attribute_count) - 1;
+
+// A mesh's vertices as one tightly packed stream per attribute, so a draw only touches the attributes
+// its shader reads. Encodings:
+//   position   3 x float, or 3 x unorm16 in a box, the mesh's bounds or one shared by the meshes of a model
+//   normal     2 x snorm16, octahedral
+//   texcoord   2 x float, or 2 x unorm16 in the mesh's uv bounds
+//   color      4 x float
+//   tangent    2 x snorm16, octahedral
+//   bitangent  2 x snorm16, octahedral
+class vertex_streams {
+public:
+    // Everything needed to decode the streams, plain data so the mesh cache can store it as is.
+    struct layout {
+        uint32_t count = 0;
+        uint32_t attributes = 0;
+        uint32_t quantized_positions = 0;
+        uint32_t quantized_texcoords = 0;
+        // quantization boxes
+        glm::vec3 position_min{0.0f};
+        glm::vec3 position_extent{0.0f};
+        glm::vec2 texcoord_min{0.0f};
+        glm::vec2 texcoord_extent{0.0f};
+        aabb bounds;
+    };
+
+    // How encode stores positions and uvs. Vertices on an edge two meshes share only stay in the same
+    // place if both meshes quantize their positions in the same box.
+    struct encoding {
+        bool quantize_positions = true;
+        // the mesh's own bounds when empty
+        aabb position_box = aabb::none();
+        // uvs spanning more than max_quantized_uv_extent stay float
+        bool quantize_texcoords = true;
+    };
+
+    // steps of 1 / 16384, a quarter texel of a 4096 texture
+    static constexpr float max_quantized_uv_extent = 4.0f;
+
+    layout info;
+    // indexed by attribute bit, empty for attributes the mesh does not have
+    array_view<const unsigned char> streams[vertex_attribute_count];
+
+    static size_t element_size(int stream, const layout &info) {
+        switch (stream) {
+            case 0:
+                return info.quantized_positions ? 3 * sizeof(uint16_t) : 3 * sizeof(float);
+            case 2:
+                return info.quantized_texcoords ? 2 * sizeof(uint16_t) : 2 * sizeof(float);
+            case 3:
+                return 4 * sizeof(float);
+            default:
+                return 2 * sizeof(uint16_t);
+        }
+    }
+
+    size_t size() const {
+        return info.count;
+    }
+
+    // Box of the positions.
+    const aabb &get_bounds() const {
+        return info.bounds;
+    }
+
+    size_t bytes() const {
+        size_t total = 0;
+        for (const auto &stream: streams)
+            total += stream.size();
+        return total;
+    }
+
+    // Decodes the requested attributes of vertex index into out, the others keep their value.
+    void fetch(uint32_t index, uint32_t attributes, vertex &out) const {
+        attributes &= info.attributes;
+        if (attributes & attribute_position) {
+            if (info.quantized_positions) {
+                const uint16_t *q = reinterpret_cast<const uint16_t *>(streams[0].data()) + 3 * index;
+                glm::vec3 p = info.position_min + info.position_extent * (glm::vec3(q[0], q[1], q[2]) / 65535.0f);
+                out.position = glm::vec4(p, 1.0f);
+            } else {
+                glm::vec3 p;
+                std::memcpy(&p, streams[0].data() + 3 * sizeof(float) * index, sizeof(p));
+                out.position = glm::vec4(p, 1.0f);
+            }
+        }
+        if (attributes & attribute_normal)
+            out.normal = decode_octahedral(streams[1].data(), index);
+        if (attributes & attribute_texcoord) {
+            if (info.quantized_texcoords) {
+                const uint16_t *q = reinterpret_cast<const uint16_t *>(streams[2].data()) + 2 * index;
+                out.texcoord = info.texcoord_min + info.texcoord_extent * (glm::vec2(q[0], q[1]) / 65535.0f);
+            } else {
+                std::memcpy(&out.texcoord, streams[2].data() + 2 * sizeof(float) * index, sizeof(out.texcoord));
+            }
+        }
+        if (attributes & attribute_color)
+            std::memcpy(&out.color, streams[3].data() + 4 * sizeof(float) * index, sizeof(out.color));
+        if (attributes & attribute_tangent)
+            out.tangent = decode_octahedral(streams[4].data(), index);
+        if (attributes & attribute_bitangent)
+            out.bitangent = decode_octahedral(streams[5].data(), index);
+    }
+
+    // Packs the given attributes of vertices into streams allocated from arena.
+    static void encode(const std::vector<vertex> &vertices, uint32_t attributes, const encoding &options,
+                       geometry_arena &arena, vertex_streams &streams) {
+        layout &info = streams.info;
+        info = layout();
+        info.count = static_cast<uint32_t>(vertices.size());
+        info.attributes = attributes & all_vertex_attributes;
+        info.quantized_positions = options.quantize_positions ? 1 : 0;
+
+        if (!vertices.empty()) {
+            info.bounds = aabb::none();
+            glm::vec2 t_min(vertices[0].texcoord), t_max(vertices[0].texcoord);
+            for (const auto &v: vertices) {
+                info.bounds.expand(glm::vec3(v.position));
+                t_min = glm::min(t_min, v.texcoord);
+                t_max = glm::max(t_max, v.texcoord);
+            }
+            const aabb &box = options.position_box.empty() ? info.bounds : options.position_box;
+            info.position_min = box.min;
+            info.position_extent = box.extent();
+            info.texcoord_min = t_min;
+            info.texcoord_extent = t_max - t_min;
+            // decoded positions are up to half a step off
+            if (info.quantized_positions) {
+                glm::vec3 half_step = info.position_extent * (0.5f / 65535.0f);
+                info.bounds = {info.bounds.min - half_step, info.bounds.max + half_step};
+            }
+        }
+        info.quantized_texcoords = options.quantize_texcoords &&
+                                   std::max(info.texcoord_extent.x, info.texcoord_extent.y) <= max_quantized_uv_extent;
+
+        for (int s = 0; s < vertex_attribute_count; ++s) {
+            streams.streams[s] = array_view<const unsigned char>();
+            if (!(info.attributes & (1u << s)))
+                continue;
+            const size_t size = element_size(s, info);
+            unsigned char *bytes = arena.allocate<unsigned char>(size * vertices.size());
+            for (size_t i = 0; i < vertices.size(); ++i)
+                encode_attribute(s, info, vertices[i], bytes + i * size);
+            streams.streams[s] = array_view<const unsigned char>(bytes, size * vertices.size());
+        }
+    }
+
+private:
+
+    static void encode_attribute(int stream, const layout &info, const vertex &v, unsigned char *out) {
+        switch (stream) {
+            case 0:
+                if (info.quantized_positions) {
+                    uint16_t q[3];
+                    for (int c = 0; c < 3; ++c)
+                        q[c] = quantize_unorm16(v.position[c], info.position_min[c], info.position_extent[c]);
+                    std::memcpy(out, q, sizeof(q));
+                } else {
+                    glm::vec3 p(v.position);
+                    std::memcpy(out, &p, sizeof(p));
+                }
+                break;
+            case 1:
+                encode_octahedral(v.normal, out);
+                break;
+            case 2:
+                if (info.quantized_texcoords) {
+                    uint16_t q[2];
+                    for (int c = 0; c < 2; ++c)
+                        q[c] = quantize_unorm16(v.texcoord[c], info.texcoord_min[c], info.texcoord_extent[c]);
+                    std::memcpy(out, q, sizeof(q));
+                } else {
+                    std::memcpy(out, &v.texcoord, sizeof(v.texcoord));
+                }
+                break;
+            case 3:
+                std::memcpy(out, &v.color, sizeof(v.color));
+                break;
+            case 4:
+                encode_octahedral(v.tangent, out);
+                break;
+            case 5:
+                encode_octahedral(v.bitangent, out);
+                break;
+            default:
+                break;
+        }
+    }
+
+    static uint16_t quantize_unorm16(float value, float min, float extent) {
+        if (extent <= 0.0f)
+            return 0;
+        float t = std::clamp((value - min) / extent, 0.0f, 1.0f);
+        return static_cast<uint16_t>(std::lround(t * 65535.0f));
+    }
+
+    static float sign_not_zero(float v) {
+        return v >= 0.0f ? 1.0f : -1.0f;
+    }
+
+    // Octahedral unit vector encoding (Cigolle et al. 2014), zero vectors decode to +z.
+    static void encode_octahedral(const glm::vec3 &n, unsigned char *out) {
+        float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+        glm::vec2 e = l1 > 0.0f ? glm::vec2(n.x, n.y) / l1 : glm::vec2(0.0f);
+        if (l1 > 0.0f && n.z < 0.0f)
+            e = glm::vec2((1.0f - std::abs(e.y)) * sign_not_zero(e.x), (1.0f - std::abs(e.x)) * sign_not_zero(e.y));
+        int16_t q[2];
+        for (int c = 0; c < 2; ++c)
+            q[c] = static_cast<int16_t>(std::lround(std::clamp(e[c], -1.0f, 1.0f) * 32767.0f));
+        std::memcpy(out, q, sizeof(q));
+    }
+
+    static glm::vec3 decode_octahedral(const unsigned char *stream, uint32_t index) {
+        int16_t q[2];
+        std::memcpy(q, stream + 2 * sizeof(int16_t) * index, sizeof(q));
+        glm::vec2 e(q[0] / 32767.0f, q[1] / 32767.0f);
+        glm::vec3 n(e.x, e.y, 1.0f - std::abs(e.x) - std::abs(e.y));
+        if (n.z < 0.0f) {
+            n.x = (1.0f - std::abs(e.y)) * sign_not_zero(e.x);
+            n.y = (1.0f - std::abs(e.x)) * sign_not_zero(e.y);
+        }
+        return glm::normalize(n);
+    }
+};
+
+// For every vertex the first one whose given attributes are bitwise equal to its own. The lookup is an
+// open addressing table of vertex indices, a few bytes per vertex where a map keyed by the attribute bytes
+// needs a node and often a string per vertex.
+inline std::vector<unsigned int> find_duplicate_vertices(const std::vector<vertex> &vertices, uint32_t attributes) {
+    struct field {
+        size_t offset;
+        size_t size;
+    };
+    field fields[vertex_attribute_count];
+    int field_count = 0;
+    if (attributes & attribute_position)
+        fields[field_count++] = {offsetof(vertex, position), 3 * sizeof(float)};
+    if (attributes & attribute_normal)
+        fields[field_count++] = {offsetof(vertex, normal), 3 * sizeof(float)};
+    if (attributes & attribute_texcoord)
+        fields[field_count++] = {offsetof(vertex, texcoord), 2 * sizeof(float)};
+    if (attributes & attribute_color)
+        fields[field_count++] = {offsetof(vertex, color), 4 * sizeof(float)};
+    if (attributes & attribute_tangent)
+        fields[field_count++] = {offsetof(vertex, tangent), 3 * sizeof(float)};
+    if (attributes & attribute_bitangent)
+        fields[field_count++] = {offsetof(vertex, bitangent), 3 * sizeof(float)};
+    auto bytes = [&](size_t v) { return reinterpret_cast<const unsigned char *>(&vertices[v]); };
+    auto hash = [&](size_t v) {
+        uint64_t h = 14695981039346656037ull;
+        for (int f = 0; f < field_count; ++f)
+            h = fnv1a_64(bytes(v) + fields[f].offset, fields[f].size, h);
+        return h;
+    };
+    auto equal = [&](size_t a, size_t b) {
+        for (int f = 0; f < field_count; ++f)
+            if (std::memcmp(bytes(a) + fields[f].offset, bytes(b) + fields[f].offset, fields[f].size) != 0)
+                return false;
+        return true;
+    };
+
+    size_t capacity = 16;
+    while (capacity < vertices.size() * 2)
+        capacity *= 2;
+    std::vector<unsigned int> table(capacity, ~0u);
+    std::vector<unsigned int> first(vertices.size());
+    for (size_t v = 0; v < vertices.size(); ++v) {
+        size_t slot = hash(v) & (capacity - 1);
+        while (table[slot] != ~0u && !equal(table[slot], v))
+            slot = (slot + 1) & (capacity - 1);
+        if (table[slot] == ~0u)
+            table[slot] = static_cast<unsigned int>(v);
+        first[v] = table[slot];
+    }
+    return first;
+}
+
+#endif //RAYTRACING_VERTEX_STREAMS_H
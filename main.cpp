@@ -7,6 +7,7 @@
 #include "shader.h"
 #include "framebuffer.h"
 #include <iostream>
+#include <cctype>
 #include "model.h"
 #include "rasterizer.h"
 #include "camera.h"
@@ -22,15 +23,101 @@ glm::mat4 get_model_matrix(glm::vec3 world_pos, float angle_x, float angle_y, fl
     return model;
 }
 
-int main() {
+// Path of frame n of an image sequence. A file name with a single %d or %0Nd, like "frame_%04d.png", gets
+// the number in its place, any other path gets "_%04d" inserted before the extension. The path is never
+// used as a format string, other % signs stay as they are.
+std::string sequence_path(const std::string &path, int frame) {
+    size_t name_start = path.find_last_of('/');
+    name_start = name_start == std::string::npos ? 0 : name_start + 1;
+    size_t percent = path.find('%', name_start);
+    if (percent != std::string::npos && path.find('%', percent + 1) == std::string::npos) {
+        size_t end = percent + 1;
+        size_t width = 0;
+        if (end < path.size() && path[end] == '0') {
+            while (++end < path.size() && std::isdigit(static_cast<unsigned char>(path[end])))
+                width = width * 10 + (path[end] - '0');
+            width = width > 0 && width <= 16 ? width : std::string::npos;
+        }
+        if (width != std::string::npos && end < path.size() && path[end] == 'd') {
+            std::string number = std::to_string(frame);
+            if (number.size() < width)
+                number.insert(0, width - number.size(), '0');
+            return path.substr(0, percent) + number + path.substr(end + 1);
+        }
+    }
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos || dot < name_start)
+        dot = path.size();
+    char number[32];
+    std::snprintf(number, sizeof(number), "_%04d", frame);
+    return path.substr(0, dot) + number + path.substr(dot);
+}
+
+// minirender [output] [--width N] [--bands ROWS] [--shm NAME] [--frames N] [--fps N] [--msaa]
+//            [--accumulate N] [--tolerance T] [--threads N] [--bilinear] [--float-vertices]
+// The output format follows the extension: .png, .qoi, .ppm or .raw. With --bands the image is rendered
+// ROWS rows at a time and streamed to a .png or .ppm file, for sizes that do not fit in memory, it
+// renders one image and takes no --frames, --accumulate or --shm. With --shm the frames are published
+// to the shared memory frame ring NAME (e.g. /minirender) instead.
+// --frames renders a turntable of N frames orbiting the camera once around its target, written as a
+// numbered image sequence (frame_%04d.png, or the frame number appended to the name) or, for a .y4m
+// output, as one uncompressed video stream. --msaa turns on 4x multisampling. --accumulate averages up
+// to N frames with jittered projections into each output frame, stopping early once the image error
+// drops below T (linear luminance, 0.002 by default); with --shm every intermediate average is published.
+// --threads limits the task scheduler to N workers, one per core by default, MINIRENDER_THREADS overrides it.
+// --bilinear filters textures bilinearly instead of taking the nearest texel. --float-vertices keeps the
+// imported positions and uvs as floats instead of 16 bit fixed point.
+int main(int argc, char **argv) {
+    std::string output_path = FileSystem::getPath("test.png");
+    int image_width = 1280;
+    int band_rows = 0;
+    std::string ring_name;
+    int frame_count = 1;
+    int fps = 30;
+    int samples = 1;
+    int accumulate_frames = 1;
+    float tolerance = 0.002f;
+    uint32_t import_flags = import_optimize_meshes | import_generate_lods | import_quantize_vertices;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--width" && i + 1 < argc)
+            image_width = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--bands" && i + 1 < argc)
+            band_rows = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--shm" && i + 1 < argc)
+            ring_name = argv[++i];
+        else if (arg == "--frames" && i + 1 < argc)
+            frame_count = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--fps" && i + 1 < argc)
+            fps = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--msaa")
+            samples = 4;
+        else if (arg == "--accumulate" && i + 1 < argc)
+            accumulate_frames = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--tolerance" && i + 1 < argc)
+            tolerance = std::strtof(argv[++i], nullptr);
+        else if (arg == "--float-vertices")
+            import_flags &= ~import_quantize_vertices;
+        else if (arg == "--bilinear")
+            image_texture::default_filter() = texture_filter::bilinear;
+        else if (arg == "--threads" && i + 1 < argc)
+            task_scheduler::set_thread_limit(static_cast<unsigned>(std::max(1, std::atoi(argv[++i]))));
+        else
+            output_path = arg;
+    }
+    if (band_rows > 0 && (frame_count > 1 || accumulate_frames > 1 || !ring_name.empty())) {
+        std::cerr << "ERROR: --bands renders a single image, it cannot be combined with --frames, --accumulate "
+                     "or --shm.\n";
+        return 1;
+    }
+
     // load models
     // ----------
-    model our_model(FileSystem::getPath("resources/objects/backpack/backpack.obj"));
+    model our_model(FileSystem::getPath("resources/objects/backpack/backpack.obj"), false, import_flags);
 //    model our_model(FileSystem::getPath("resources/objects/cube/cube.obj"));
 
     // Image
     const float aspect_ratio = 16.0 / 9.0;
-    const int image_width = 1280;
     const int image_height = static_cast<int>(image_width / aspect_ratio);
     const int image_channel = 3;
     float eye_fov = 45.f;
@@ -48,7 +135,8 @@ int main() {
     render->push_spot_light(spot_li);
 
 //    raster.
-    rasterizer raster(image_width, image_height, image_channel, render);
+    rasterizer raster(image_width, band_rows > 0 ? std::min(band_rows, image_height) : image_height, image_channel,
+                      render, framebuffer_layout::tiled, depth_format::d32f, samples);
     glm::vec4 background_color(0.05f, 0.05f, 0.05f, 1.0f);
     raster.clear_color_buffer(background_color);
 
@@ -58,11 +146,75 @@ int main() {
 
     raster.set_model_matrix(model_transformation);
     raster.set_view_matrix(view);
+    raster.set_camera_pos(cam.get_position());
     raster.set_projection_matrix(projection);
 
-    our_model.draw(raster);
+    if (band_rows > 0) {
+        std::unique_ptr<row_writer> out = row_writer::open(output_path, image_width, image_height, image_channel);
+        if (!out || !raster.render_banded(image_height, projection, [&] { our_model.draw(raster); }, *out))
+            return 1;
+        std::cerr << "\nDone.\n";
+        return 0;
+    }
+
+    std::unique_ptr<frame_ring> ring;
+    std::shared_ptr<y4m_writer> video;
+    if (!ring_name.empty()) {
+        ring = frame_ring::create(ring_name, 3, image_width, image_height, image_channel);
+        if (!ring)
+            return 1;
+    } else if (output_path.size() > 4 && output_path.compare(output_path.size() - 4, 4, ".y4m") == 0) {
+        video = std::make_shared<y4m_writer>(output_path, image_width, image_height, fps);
+        if (!video->is_open()) {
+            std::cerr << "ERROR: Could not open video file '" << output_path << "'.\n";
+            return 1;
+        }
+    }
+
+    accumulator frames(accumulate_frames > 1 ? image_width : 0, accumulate_frames > 1 ? image_height : 0);
+    // the encoder thread writes frame n while frame n + 1 is rasterized
+    for (int frame = 0; frame < frame_count; ++frame) {
+        if (frame > 0)
+            cam.orbit(360.0f / frame_count);
+        raster.set_view_matrix(cam.get_view_matrix());
+        raster.set_camera_pos(cam.get_position());
+        frames.reset();
+        for (int subframe = 0; subframe < accumulate_frames; ++subframe) {
+            if (accumulate_frames > 1)
+                raster.set_projection_matrix(cam.get_jittered_projection_matrix(accumulator::jitter(subframe),
+                                                                                image_width, image_height));
+            raster.clear_color_buffer(background_color);
+            raster.clear_depth_buffer();
+            our_model.draw(raster);
+            if (accumulate_frames == 1)
+                break;
+            raster.accumulate(frames);
+            // progressive preview
+            if (ring) {
+                raster.show_accumulated(frames);
+                if (!raster.output_frame(*ring))
+                    return 1;
+            }
+            if (frames.get_error() < tolerance)
+                break;
+        }
+        if (accumulate_frames > 1) {
+            std::cerr << "frame " << frame << ": averaged " << frames.get_frame_count() << " frames\n";
+            raster.show_accumulated(frames);
+        }
 
-    raster.ouput_image();
+        if (ring) {
+            if (accumulate_frames == 1 && !raster.output_frame(*ring))
+                return 1;
+        } else if (video) {
+            auto captured = std::make_shared<image>(raster.capture_image());
+            image_encoder::instance().submit([video, captured] { return video->write_frame(*captured); });
+        } else {
+            raster.output_image(frame_count > 1 ? sequence_path(output_path, frame) : output_path);
+        }
+    }
+    if (!image_encoder::instance().wait())
+        return 1;
 
     std::cerr << "\nDone.\n";
     return 0;